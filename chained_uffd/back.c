@@ -8,7 +8,6 @@
 #include <pthread.h>
 #include <sys/un.h>
 #include <sys/mman.h>
-#include <sys/time.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -16,20 +15,22 @@
 #include <linux/memfd.h>
 #include <linux/userfaultfd.h>
 
+#include "../common/doorbell.h"
+#include "../common/timing.h"
+
 const int PAGE_SIZE = 4096;
 const int NUM_PAGES = 20;
 const int SIZE = PAGE_SIZE * NUM_PAGES;
 const char* SERVER_SOCKET_PATH = "test_socket";
 const char* UFFD_SOCKET_PATH = "test_socket_uffd";
 
-#define LOG_TIME(fn) \
-    struct timeval tv; \
-    gettimeofday(&tv,NULL); \
-    unsigned long before = 1000000 * tv.tv_sec + tv.tv_usec; \
-    fn; \
-    gettimeofday(&tv,NULL); \
-    unsigned long after = 1000000 * tv.tv_sec + tv.tv_usec; \
-    printf("diff: %ld us (%ld ms)\n", after - before, (after - before) / 1000); 
+// The page after the data holds the doorbells front and back use to
+// follow each other through the setup, see common/doorbell.h.
+struct control {
+  struct doorbell bound;  // front bound the server socket again
+  struct doorbell ready;  // front handed its uffd to the uffd server
+  struct doorbell done;   // back is done reading
+};
 
 int get_mmfd(int sockfd) {
   printf("Waiting for memfd message\n");
@@ -125,6 +126,13 @@ int main() {
   }
   printf("memfd_map: %p\n", memfd_map);
 
+  struct control* control = (struct control*)mmap(0, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                                  memfd, SIZE);
+  if (control == MAP_FAILED) {
+    perror("control map failed");
+    exit(EXIT_FAILURE);
+  }
+
   // CREATE AND REGISTER UFFD
   printf("Creating uffd\n");
   int uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
@@ -136,7 +144,9 @@ int main() {
 
   struct uffdio_api uffdio_api;
   uffdio_api.api = UFFD_API;
-  uffdio_api.features = 0;
+  // The front proxy resolves our faults with UFFDIO_CONTINUE, which
+  // only maps pages that already sit in the memfd page cache.
+  uffdio_api.features = UFFD_FEATURE_MINOR_SHMEM;
   if (ioctl(uffd, UFFDIO_API, &uffdio_api) == -1) {
     perror("uffd_api failed");
     exit(EXIT_FAILURE);
@@ -146,7 +156,10 @@ int main() {
   struct uffdio_register  uffdio_register;
   uffdio_register.range.start = (uint64_t)memfd_map;
   uffdio_register.range.len = SIZE;
-  uffdio_register.mode = UFFDIO_REGISTER_MODE_MISSING;
+  // MISSING faults: the page is not in the page cache yet, the proxy
+  // has to get it restored first. MINOR faults: the front already
+  // faulted it in, only our PTE is missing.
+  uffdio_register.mode = UFFDIO_REGISTER_MODE_MISSING | UFFDIO_REGISTER_MODE_MINOR;
   if (ioctl(uffd, UFFDIO_REGISTER, &uffdio_register) == -1) {
     perror("uffd_register failed");
     exit(EXIT_FAILURE);
@@ -154,6 +167,12 @@ int main() {
   printf("uffd_register done\n");
 
   // CONNECT TO THE SOCKET
+  // Front unlinks the socket and binds it again after sending the
+  // memfd, connecting before that would connect us to ourselves.
+  if (doorbell_wait(&control->bound, 0, 10000) < 0) {
+    perror("front did not bind its socket");
+    exit(EXIT_FAILURE);
+  }
   if (connect(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
     perror("connect failed");
     exit(EXIT_FAILURE);
@@ -163,18 +182,31 @@ int main() {
   printf("Sending uffd back\n");
   send_uffd(sockfd, (uint64_t)memfd_map, uffd);
   
-  printf("sleeping for 1 second\n");
-  sleep(1);
+  // Faults block until front has registered with the uffd server.
+  printf("waiting for front\n");
+  if (doorbell_wait(&control->ready, 0, 10000) < 0) {
+    perror("front did not register with the uffd server");
+    exit(EXIT_FAILURE);
+  }
 
   // DO PAGE FAULT
+  // The first read of every page may fault, the second one never does.
+  struct histogram read_hist[2];
+  hist_init(&read_hist[0], "first read");
+  hist_init(&read_hist[1], "second read");
   for (int p = 0; p < NUM_PAGES; p++) {
     for (int i = 0; i < 2; i++) {
-      char* ptr = memfd_map + PAGE_SIZE * p;
-      LOG_TIME(char c = *(ptr))
+      volatile char* ptr = memfd_map + PAGE_SIZE * p;
+      TIME_INTO(read_hist[i], char c = *(ptr))
       printf("Read page: %d, address %p, offset: %d, byte: %c\n", p, ptr, ptr - memfd_map, c);
     }
   }
+  hist_print(&read_hist[0]);
+  hist_print(&read_hist[1]);
+
+  doorbell_ring(&control->done);
 
+  munmap(control, PAGE_SIZE);
   munmap(memfd_map, SIZE);
   close(sockfd);
 }
@@ -2,6 +2,7 @@
 #include <poll.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <inttypes.h>
@@ -15,16 +16,36 @@
 #include <linux/memfd.h>
 #include <linux/userfaultfd.h>
 
+#include "../common/doorbell.h"
+#include "../common/trace.h"
+
 const int PAGE_SIZE = 4096;
 const int NUM_PAGES = 20;
 const int SIZE = PAGE_SIZE * NUM_PAGES;
 const char* SERVER_SOCKET_PATH = "test_socket";
 const char* UFFD_SOCKET_PATH = "test_socket_uffd";
 
+// The page after the data holds the doorbells front and back use to
+// follow each other through the setup, see common/doorbell.h.
+struct control {
+  struct doorbell bound;  // front bound the server socket again
+  struct doorbell ready;  // front handed its uffd to the uffd server
+  struct doorbell done;   // back is done reading
+};
+
+// Max number of messages drained from the uffd with one read().
+// Build with -DMSGS_PER_READ=1 to read a single message per call.
+#ifndef MSGS_PER_READ
+#define MSGS_PER_READ 16
+#endif
+
 struct thread_data {
   int uffd;
   uint64_t uffd_addr;
   char* memfd_map;
+  // Faults seen so far, and how many of them were minor.
+  int fault_cnt;
+  int minor_cnt;
 };
 
 void* proxy_uffd_handler(void *arg) {
@@ -34,66 +55,95 @@ void* proxy_uffd_handler(void *arg) {
   uint64_t uffd_addr = td->uffd_addr;
   char* memfd_map = td->memfd_map;
 
+  int fault_cnt = 0;
+  // poll() and read() calls so far
+  unsigned long syscalls = 0;
+  struct uffd_msg msgs[MSGS_PER_READ];
   for (;;) {
       // See what poll() tells us about the userfaultfd.
       struct pollfd pollfd;
       pollfd.fd = uffd;
       pollfd.events = POLLIN;
       int nready = poll(&pollfd, 1, -1);
+      syscalls++;
       if (nready == -1) {
         printf("poll failed\n");
         exit(EXIT_FAILURE);
       }
 
-      printf("\nfault_handler_thread():\n");
-      printf("    poll() returns: nready = %d; "
-             "POLLIN = %d; POLLERR = %d\n", nready,
-             (pollfd.revents & POLLIN) != 0,
-             (pollfd.revents & POLLERR) != 0);
-
-      // Read an event from the userfaultfd.
-      struct uffd_msg msg;
-      int nread = read(uffd, &msg, sizeof(msg));
-      if (nread == 0) {
-          printf("uffd thread read EOF\n");
-          exit(EXIT_FAILURE);
-      }
-
-      if (nread == -1){
-        printf("uffd thread read failed\n");
-        exit(EXIT_FAILURE);
-      }
-
-      // We expect only one kind of event; verify that assumption.
-      if (msg.event != UFFD_EVENT_PAGEFAULT) {
-          printf("Unexpected event on userfaultfd\n");
-          exit(EXIT_FAILURE);
-      }
-
-      // Display info about the page-fault event.
-      printf("    UFFD_EVENT_PAGEFAULT event: ");
-      printf("flags = %"PRIx64"; ", msg.arg.pagefault.flags);
-      printf("address = %"PRIx64"\n", msg.arg.pagefault.address);
-
-      uint64_t offset = msg.arg.pagefault.address - uffd_addr;
-      uint64_t address = (uint64_t)memfd_map + offset;
-      printf("Causing follow up page fault with address: %x, offset: %d\n", address, offset);
-      char c = *(char*)address;
-
-      printf("Continuing");
-      struct uffdio_continue uffdio_continue;
-      uffdio_continue.range.start = (unsigned long) msg.arg.pagefault.address & ~(PAGE_SIZE - 1);
-      uffdio_continue.range.len = PAGE_SIZE;
-      uffdio_continue.mode = 0;
-      uffdio_continue.mapped = 0;
-
-      if (ioctl(uffd, UFFDIO_CONTINUE, &uffdio_continue) == -1) {
-          printf("UFFDIO_CONTINUE failed\n");
-          exit(EXIT_FAILURE);
+      trace(TRACE_POLL, uffd, 0, pollfd.revents, nready);
+
+      // Drain the userfaultfd, reading up to MSGS_PER_READ events
+      // per read(), and resolve the whole batch before going
+      // back to poll().
+      int batch_faults = 0;
+      for (;;) {
+          int nread = read(uffd, msgs, sizeof(msgs));
+          syscalls++;
+          if (nread == 0) {
+              printf("uffd thread read EOF\n");
+              exit(EXIT_FAILURE);
+          }
+
+          if (nread == -1) {
+            if (errno == EAGAIN)
+              break;
+            printf("uffd thread read failed\n");
+            exit(EXIT_FAILURE);
+          }
+
+          int nmsgs = nread / sizeof(struct uffd_msg);
+          for (int i = 0; i < nmsgs; i++) {
+              struct uffd_msg* msg = &msgs[i];
+
+              // We expect only one kind of event; verify that assumption.
+              if (msg->event != UFFD_EVENT_PAGEFAULT) {
+                  printf("Unexpected event on userfaultfd\n");
+                  exit(EXIT_FAILURE);
+              }
+
+              // Record the page-fault event, decoded off this thread.
+              trace(TRACE_FAULT, uffd, msg->arg.pagefault.address,
+                    msg->arg.pagefault.flags, 0);
+
+              // A minor fault means the page is in the page cache
+              // already. A missing one has to be restored first, which
+              // a follow up fault on our own mapping asks the uffd
+              // server to do.
+              if (msg->arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_MINOR) {
+                td->minor_cnt++;
+              } else {
+                uint64_t offset = msg->arg.pagefault.address - uffd_addr;
+                volatile char* address = (char*)memfd_map + offset;
+                char c = *address;
+              }
+
+              struct uffdio_continue uffdio_continue;
+              uffdio_continue.range.start = (unsigned long) msg->arg.pagefault.address & ~(PAGE_SIZE - 1);
+              uffdio_continue.range.len = PAGE_SIZE;
+              uffdio_continue.mode = 0;
+              uffdio_continue.mapped = 0;
+
+              if (ioctl(uffd, UFFDIO_CONTINUE, &uffdio_continue) == -1) {
+                  printf("UFFDIO_CONTINUE failed\n");
+                  exit(EXIT_FAILURE);
+              }
+              fault_cnt++;
+              td->fault_cnt = fault_cnt;
+              batch_faults++;
+
+              trace(TRACE_CONTINUE, uffd, uffdio_continue.range.start, 0,
+                    uffdio_continue.mapped);
+          }
+
+          // A short read means the queue is empty. With one message per read,
+          // go back to poll() after every fault like the unbatched loop.
+          if (MSGS_PER_READ == 1 || nmsgs < MSGS_PER_READ)
+            break;
       }
 
-      printf("        (uffdio_continue.mapped returned %"PRId64")\n",
-             uffdio_continue.mapped);
+      // Unbatched handling costs one poll() and one read() per fault.
+      trace(TRACE_BATCH, uffd, syscalls, batch_faults, fault_cnt);
   }
 }
 
@@ -155,6 +205,37 @@ void send_fd(int sockfd, int fd) {
   } 
 }
 
+void send_fd_and_addr(int sockfd, int fd, uint64_t addr) {
+  struct iovec iov = {
+    .iov_base = &addr,
+    .iov_len = sizeof(uint64_t),
+  };
+  char buff[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg = {
+    .msg_name = 0,
+    .msg_namelen = 0,
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = &buff,
+    .msg_controllen = sizeof(buff),
+    .msg_flags = 0,
+  };
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  int* data = (int*)CMSG_DATA(cmsg);
+  memcpy(data, &fd, sizeof(int));
+
+  printf("sending FD: %d\n", fd);
+  int r = sendmsg(sockfd, &msg, 0);
+  if (r < 0) {
+    perror("sending uffd fd");
+    exit(EXIT_FAILURE);
+  } 
+}
+
 int get_uffd_from_backend(int sockfd, uint64_t* addr) {
   struct iovec iov = { 
     .iov_base = addr, 
@@ -192,7 +273,7 @@ int main() {
   }
   printf("memfd: %d\n", memfd);
 
-  int r = ftruncate(memfd, SIZE);
+  int r = ftruncate(memfd, SIZE + PAGE_SIZE);
   if (r < 0) {
     perror("memfd failed\n");
     exit(EXIT_FAILURE);
@@ -205,6 +286,14 @@ int main() {
   }
   printf("memfd_map: %p\n", memfd_map);
 
+  // Not registered with any uffd, so it never faults.
+  struct control* control = (struct control*)mmap(0, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                                  memfd, SIZE);
+  if (control == MAP_FAILED) {
+    perror("control map failed");
+    exit(EXIT_FAILURE);
+  }
+
   // CREATE SOCKET
   int back_sockfd = socket(AF_UNIX, SOCK_DGRAM, 0);
   if (back_sockfd < 0) {
@@ -227,6 +316,7 @@ int main() {
   // BIND SOCKET
   printf("Bingin backend socket: %s\n", SERVER_SOCKET_PATH);
   bind_socket(back_sockfd, SERVER_SOCKET_PATH);
+  doorbell_ring(&control->bound);
 
   // RECIEVE UFFD FROM BACKEND
   printf("Waiting for uffd message\n");
@@ -237,6 +327,7 @@ int main() {
 
   // CREATE UFFD PROXY THREAD
   printf("Creating proxy uffd thread\n");
+  trace_start();
   struct thread_data td = {
     .uffd = back_uffd,
     .uffd_addr = back_uffd_addr,
@@ -290,12 +381,21 @@ int main() {
   connect_socket(uffd_sockfd, UFFD_SOCKET_PATH);
 
   // SEND LOCAL UFFD
+  // The address lets the uffd server turn fault addresses into
+  // offsets into the region.
   printf("Sending local_uffd\n");
-  send_fd(uffd_sockfd, local_uffd);
+  send_fd_and_addr(uffd_sockfd, local_uffd, (uint64_t)memfd_map);
+
+  doorbell_ring(&control->ready);
+
+  printf("Waiting for the backend to finish\n");
+  if (doorbell_wait(&control->done, 0, 10000) < 0)
+    printf("backend did not finish within 10 seconds\n");
 
-  printf("Sleeping for 2 seconds");
-  sleep(2);
+  trace_stop();
+  printf("proxied %d faults of the backend, %d were minor\n", td.fault_cnt, td.minor_cnt);
 
+  munmap(control, PAGE_SIZE);
   munmap(memfd_map, SIZE);
   close(memfd);
   close(back_sockfd);
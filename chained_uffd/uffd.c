@@ -1,13 +1,16 @@
 #define _GNU_SOURCE
 #include <poll.h>
+#include <time.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <inttypes.h>
 #include <pthread.h>
 #include <sys/un.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -15,13 +18,72 @@
 #include <linux/memfd.h>
 #include <linux/userfaultfd.h>
 
+#include "../common/trace.h"
+#include "../common/zero_page.h"
+
 const int PAGE_SIZE = 4096;
 const int NUM_PAGES = 20;
 const int SIZE = PAGE_SIZE * NUM_PAGES;
 const char* SERVER_SOCKET_PATH = "test_socket";
 const char* UFFD_SOCKET_PATH = "test_socket_uffd";
 
-int main() {
+// Max number of messages drained from the uffd with one read().
+// Build with -DMSGS_PER_READ=1 to read a single message per call.
+#ifndef MSGS_PER_READ
+#define MSGS_PER_READ 16
+#endif
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+// Map the snapshot file that backs the front memory.
+char* map_snapshot(const char* path, uint64_t* size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror("open snapshot failed");
+    exit(EXIT_FAILURE);
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    perror("fstat snapshot failed");
+    exit(EXIT_FAILURE);
+  }
+  *size = st.st_size;
+
+  char* snapshot = (char*)mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (snapshot == MAP_FAILED) {
+    perror("snapshot map failed");
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+  printf("snapshot: %s, %"PRIu64" bytes\n", path, *size);
+  return snapshot;
+}
+
+// Usage: ./uffd [snapshot_file [zero_page_scanner]]
+// Without a snapshot file every fault is served with a memset page.
+// All-zero snapshot pages are served with UFFDIO_ZEROPAGE, unless the
+// scanner is "none": then the snapshot is not scanned and every page
+// is copied.
+int main(int argc, char** argv) {
+  char* snapshot = NULL;
+  uint64_t snapshot_size = 0;
+  uint64_t* zero_pages = NULL;
+  if (argc > 1)
+    snapshot = map_snapshot(argv[1], &snapshot_size);
+  if (argc > 1 && !(argc > 2 && !strcmp(argv[2], "none"))) {
+    ZeroScanner* scanner = zero_scanner(argc > 2 ? argv[2] : NULL);
+    uint64_t zero_count;
+    uint64_t before = now_ns();
+    zero_pages = zero_page_bitmap(scanner, snapshot, snapshot_size, PAGE_SIZE, &zero_count);
+    printf("zero pages: %"PRIu64" of %"PRIu64", scanned in %"PRIu64" us with %s\n",
+           zero_count, snapshot_size / PAGE_SIZE, (now_ns() - before) / 1000, scanner->name);
+  }
+
   // CREATE SOCKET
   printf("Creating socket to uffd\n");
   int sockfd = socket(AF_UNIX, SOCK_DGRAM, 0);
@@ -45,10 +107,10 @@ int main() {
 
   // RECIEVE UFFD FROM FRONT
   printf("Waiting for uffd message from frondend\n");
-  char iov_dummy;
+  uint64_t front_addr;
   struct iovec iov = { 
-    .iov_base = &iov_dummy, 
-    .iov_len = sizeof(char) 
+    .iov_base = &front_addr, 
+    .iov_len = sizeof(uint64_t) 
   };
   char buff[CMSG_SPACE(sizeof(int))];
 
@@ -68,6 +130,7 @@ int main() {
   struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
   int uffd = *(int*)CMSG_DATA(cmsg);
   printf("uffd: %d\n", uffd);
+  printf("front_addr: %p\n", front_addr);
 
   // CREATE AN EMPTY PAGE
   char* page = (char*)mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
@@ -78,10 +141,17 @@ int main() {
 
   // Loop, handling incoming events on the userfaultfd file descriptor.
   // Number of faults so far handled
-  int fault_cnt = 0; 
+  int fault_cnt = 0;
+  // poll() and read() calls so far
+  unsigned long syscalls = 0;
+  // Time spent in UFFDIO_COPY/UFFDIO_ZEROPAGE so far
+  uint64_t copy_ns = 0;
+  int zero_cnt = 0;
+  struct uffd_msg msgs[MSGS_PER_READ];
+  trace_start();
   for (;;) {
       // We only trigger NUM_PAGES page faults
-      if (fault_cnt == NUM_PAGES) {
+      if (fault_cnt >= NUM_PAGES) {
         break;
       }
 
@@ -89,65 +159,111 @@ int main() {
       pollfd.fd = uffd;
       pollfd.events = POLLIN;
       int nready = poll(&pollfd, 1, -1);
+      syscalls++;
       if (nready == -1) {
         perror("poll failed");
         exit(EXIT_FAILURE);
       }
 
-      printf("\nfault_handler_thread():\n");
-      printf("    poll() returns: nready = %d; "
-             "POLLIN = %d; POLLERR = %d\n", nready,
-             (pollfd.revents & POLLIN) != 0,
-             (pollfd.revents & POLLERR) != 0);
-
-      // Read an event from the userfaultfd.
-      struct uffd_msg msg;
-      int nread = read(uffd, &msg, sizeof(msg));
-      if (nread == 0) {
-          perror("EOF on userfaultfd");
-          exit(EXIT_FAILURE);
-      }
+      trace(TRACE_POLL, uffd, 0, pollfd.revents, nready);
 
-      if (nread == -1){
-        perror("uffd thread read failed");
-        exit(EXIT_FAILURE);
-      }
+      // Drain the userfaultfd, reading up to MSGS_PER_READ events
+      // per read(), and resolve the whole batch before going
+      // back to poll().
+      int batch_faults = 0;
+      for (;;) {
+          int nread = read(uffd, msgs, sizeof(msgs));
+          syscalls++;
+          if (nread == 0) {
+              perror("EOF on userfaultfd");
+              exit(EXIT_FAILURE);
+          }
 
-      // We expect only one kind of event; verify that assumption.
-      if (msg.event != UFFD_EVENT_PAGEFAULT) {
-          perror("Unexpected event on userfaultfd");
-          exit(EXIT_FAILURE);
-      }
+          if (nread == -1) {
+            if (errno == EAGAIN)
+              break;
+            perror("uffd thread read failed");
+            exit(EXIT_FAILURE);
+          }
+
+          int nmsgs = nread / sizeof(struct uffd_msg);
+          for (int i = 0; i < nmsgs; i++) {
+              struct uffd_msg* msg = &msgs[i];
+
+              // We expect only one kind of event; verify that assumption.
+              if (msg->event != UFFD_EVENT_PAGEFAULT) {
+                  perror("Unexpected event on userfaultfd");
+                  exit(EXIT_FAILURE);
+              }
+
+              // Record the page-fault event, decoded off this thread.
+              trace(TRACE_FAULT, uffd, msg->arg.pagefault.address,
+                    msg->arg.pagefault.flags, 0);
+
+              //We need to handle page faults in units of pages(!).
+              //So, round faulting address down to page boundary.
+              uint64_t page_addr = (uint64_t)msg->arg.pagefault.address & ~(PAGE_SIZE - 1);
+
+              struct uffdio_copy uffdio_copy;
+              uint64_t offset = page_addr - front_addr;
+              if (snapshot) {
+                // Copy straight out of the snapshot mapping at the
+                // same offset the fault has in the front region.
+                if (offset + PAGE_SIZE > snapshot_size) {
+                  printf("fault at offset %"PRIu64" is past the snapshot end\n", offset);
+                  exit(EXIT_FAILURE);
+                }
+                uffdio_copy.src = (unsigned long) snapshot + offset;
+              } else {
+                //Copy the page pointed to by 'page' into the faulting
+                //region. Vary the contents that are copied in, so that it
+                //is more obvious that each fault is handled separately.
+                memset(page, 'A' + fault_cnt % 20, PAGE_SIZE);
+                uffdio_copy.src = (unsigned long) page;
+              }
+              fault_cnt++;
+              batch_faults++;
+
+              uint64_t before = now_ns();
+              int zero = zero_pages && zero_page_test(zero_pages, offset / PAGE_SIZE);
+              if (zero) {
+                struct uffdio_zeropage uffdio_zeropage;
+                uffdio_zeropage.range.start = page_addr;
+                uffdio_zeropage.range.len = PAGE_SIZE;
+                uffdio_zeropage.mode = 0;
+                uffdio_zeropage.zeropage = 0;
+                if (ioctl(uffd, UFFDIO_ZEROPAGE, &uffdio_zeropage) == -1) {
+                    perror("UFFDIO_ZEROPAGE");
+                    exit(EXIT_FAILURE);
+                }
+                uffdio_copy.copy = uffdio_zeropage.zeropage;
+                zero_cnt++;
+              } else {
+                uffdio_copy.dst = page_addr;
+                uffdio_copy.len = PAGE_SIZE;
+                uffdio_copy.mode = 0;
+                uffdio_copy.copy = 0;
+                if (ioctl(uffd, UFFDIO_COPY, &uffdio_copy) == -1) {
+                    perror("UFFDIO_COPY");
+                    exit(EXIT_FAILURE);
+                }
+              }
+              copy_ns += now_ns() - before;
+              trace(zero ? TRACE_ZEROPAGE : TRACE_COPY, uffd, page_addr, 0, uffdio_copy.copy);
+          }
 
-      // Display info about the page-fault event.
-      printf("    UFFD_EVENT_PAGEFAULT event: ");
-      printf("flags = %"PRIx64"; ", msg.arg.pagefault.flags);
-      printf("address = %"PRIx64"\n", msg.arg.pagefault.address);
-
-      //Copy the page pointed to by 'page' into the faulting
-      //region. Vary the contents that are copied in, so that it
-      //is more obvious that each fault is handled separately. 
-      memset(page, 'A' + fault_cnt % 20, PAGE_SIZE);
-      fault_cnt++;
-
-      struct uffdio_copy uffdio_copy;
-      uffdio_copy.src = (unsigned long) page;
-
-      //We need to handle page faults in units of pages(!).
-      //So, round faulting address down to page boundary.
-
-      uffdio_copy.dst = (unsigned long) msg.arg.pagefault.address & ~(PAGE_SIZE - 1);
-      uffdio_copy.len = PAGE_SIZE;
-      uffdio_copy.mode = 0;
-      uffdio_copy.copy = 0;
-      if (ioctl(uffd, UFFDIO_COPY, &uffdio_copy) == -1) {
-          perror("UFFDIO_COPY");
-          exit(EXIT_FAILURE);
+          // A short read means the queue is empty. With one message per read,
+          // go back to poll() after every fault like the unbatched loop.
+          if (MSGS_PER_READ == 1 || nmsgs < MSGS_PER_READ)
+            break;
       }
 
-      printf("        (uffdio_copy.copy returned %"PRId64")\n",
-             uffdio_copy.copy);
+      // Unbatched handling costs one poll() and one read() per fault.
+      trace(TRACE_BATCH, uffd, syscalls, batch_faults, fault_cnt);
   }
 
+  trace_stop();
+  printf("avg restore latency: %"PRIu64" ns/page, %d of %d pages were zero\n",
+         copy_ns / fault_cnt, zero_cnt, fault_cnt);
   return 0;
 }
@@ -0,0 +1,103 @@
+#ifndef DOORBELL_H
+#define DOORBELL_H
+
+// Cross-process wakeups through a word in shared memory (a memfd
+// mapped MAP_SHARED by both sides). Ringing bumps a sequence number;
+// a waiter remembers the number it saw before checking its condition
+// and sleeps until it changes. It spins for a short while first, since
+// the other side is often only microseconds away, then sleeps in
+// FUTEX_WAIT. The ringer only makes the FUTEX_WAKE syscall when some
+// waiter has gone to sleep.
+//
+// A fresh memfd reads as zeroes, so a one-shot "ready" signal is
+// doorbell_wait(d, 0, ...) on one side and doorbell_ring(d) on the
+// other, in any order.
+//
+// The futex calls are not FUTEX_PRIVATE_FLAG: the word is shared
+// between processes.
+
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define DOORBELL_SPINS 2000
+
+struct doorbell {
+  uint32_t seq;
+  uint32_t waiters;
+} __attribute__((aligned(64)));
+
+static inline void doorbell_relax() {
+#if defined(__x86_64__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+static inline uint32_t doorbell_seq(struct doorbell* d) {
+  return __atomic_load_n(&d->seq, __ATOMIC_ACQUIRE);
+}
+
+// Everything written before the ring is visible to a waiter that sees
+// the new sequence number.
+static inline void doorbell_ring(struct doorbell* d) {
+  // Sequentially consistent on both sides: either we see the waiter
+  // count, or the waiter sees the new sequence number before it sleeps.
+  __atomic_fetch_add(&d->seq, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&d->waiters, __ATOMIC_SEQ_CST))
+    syscall(SYS_futex, &d->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Wait until the sequence number is no longer `seen`, at most
+// `timeout_ms` (-1: no limit). 0 once rung, -1 with errno ETIMEDOUT.
+static inline int doorbell_wait(struct doorbell* d, uint32_t seen, int timeout_ms) {
+  for (int i = 0; i < DOORBELL_SPINS; i++) {
+    if (doorbell_seq(d) != seen)
+      return 0;
+    doorbell_relax();
+  }
+
+  struct timespec deadline;
+  if (timeout_ms >= 0) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000l;
+    if (deadline.tv_nsec >= 1000000000l) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000l;
+    }
+  }
+
+  int ret = 0;
+  __atomic_fetch_add(&d->waiters, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&d->seq, __ATOMIC_SEQ_CST) == seen) {
+    struct timespec left, *timeout = NULL;
+    if (timeout_ms >= 0) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      left.tv_sec = deadline.tv_sec - now.tv_sec;
+      left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+      if (left.tv_nsec < 0) {
+        left.tv_sec--;
+        left.tv_nsec += 1000000000l;
+      }
+      if (left.tv_sec < 0) {
+        errno = ETIMEDOUT;
+        ret = -1;
+        break;
+      }
+      timeout = &left;
+    }
+    // EAGAIN: rung between our check and the syscall. EINTR: retry.
+    syscall(SYS_futex, &d->seq, FUTEX_WAIT, seen, timeout, NULL, 0);
+  }
+  __atomic_fetch_sub(&d->waiters, 1, __ATOMIC_SEQ_CST);
+  return ret;
+}
+
+#endif
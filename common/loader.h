@@ -0,0 +1,142 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+// Parallel snapshot loader: fills a memfd from a file with several
+// threads, each pread()ing chunks straight into the memfd mapping. The
+// threads claim chunks from a shared offset, so one slow thread does
+// not hold up the rest. The memfd is allocated with fallocate() before
+// the copy starts, and the mapping is populated, so the copy takes no
+// shmem allocation and no page faults.
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define LOADER_MAX_THREADS 256
+
+struct parallel_load {
+  int fd;
+  uint64_t file_off;
+  char* dst;
+  uint64_t size;
+  uint64_t chunk;
+  uint64_t next;
+  // First error seen by any thread, the others stop at their next chunk.
+  int error;
+};
+
+static void* loader_thread(void* arg) {
+  struct parallel_load* l = (struct parallel_load*)arg;
+  while (!__atomic_load_n(&l->error, __ATOMIC_RELAXED)) {
+    uint64_t off = __atomic_fetch_add(&l->next, l->chunk, __ATOMIC_RELAXED);
+    if (off >= l->size)
+      break;
+    uint64_t end = off + l->chunk < l->size ? off + l->chunk : l->size;
+    while (off < end) {
+      ssize_t n = pread(l->fd, l->dst + off, end - off, l->file_off + off);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0) {
+        int err = n < 0 ? errno : EIO;
+        __atomic_compare_exchange_n(&l->error, &(int){0}, err, 0, __ATOMIC_RELAXED,
+                                    __ATOMIC_RELAXED);
+        return NULL;
+      }
+      off += n;
+    }
+  }
+  return NULL;
+}
+
+// Read `size` bytes of `fd` from `file_off` into `dst` with `threads`
+// threads and `chunk` bytes per pread. Returns 0, or -1 with errno set.
+static inline int parallel_pread(int fd, uint64_t file_off, char* dst, uint64_t size, int threads,
+                                 uint64_t chunk) {
+  if (threads < 1 || threads > LOADER_MAX_THREADS || chunk == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  struct parallel_load l = {
+    .fd = fd,
+    .file_off = file_off,
+    .dst = dst,
+    .size = size,
+    .chunk = chunk,
+    .next = 0,
+    .error = 0,
+  };
+  pthread_t tids[LOADER_MAX_THREADS];
+  int started = 0;
+  // The calling thread is one of the loaders.
+  for (; started < threads - 1; started++) {
+    if (pthread_create(&tids[started], NULL, loader_thread, &l) != 0)
+      break;
+  }
+  loader_thread(&l);
+  for (int i = 0; i < started; i++)
+    pthread_join(tids[i], NULL);
+  if (l.error) {
+    errno = l.error;
+    return -1;
+  }
+  return 0;
+}
+
+// Create a memfd of `size` bytes, allocated up front with fallocate(),
+// and map it shared and populated. Returns the mapping and the memfd
+// in `memfd`, or NULL with errno set.
+static inline char* loader_memfd(const char* name, uint64_t size, int* memfd) {
+  int fd = syscall(SYS_memfd_create, name, 0);
+  if (fd < 0)
+    return NULL;
+  if (fallocate(fd, 0, 0, size) < 0) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return NULL;
+  }
+  char* map = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+  if (map == MAP_FAILED) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return NULL;
+  }
+  *memfd = fd;
+  return map;
+}
+
+// Load the whole file at `path` into a new memfd. Returns its mapping,
+// the memfd and the file size, or NULL with errno set.
+static inline char* load_file(const char* path, int threads, uint64_t chunk, int* memfd,
+                              uint64_t* size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  char* map = NULL;
+  if (fstat(fd, &st) == 0 && (map = loader_memfd(path, st.st_size, memfd)) &&
+      parallel_pread(fd, 0, map, st.st_size, threads, chunk) < 0) {
+    munmap(map, st.st_size);
+    close(*memfd);
+    map = NULL;
+  }
+  int err = errno;
+  close(fd);
+  errno = err;
+  if (map)
+    *size = st.st_size;
+  return map;
+}
+
+#endif
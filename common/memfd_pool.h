@@ -0,0 +1,211 @@
+#ifndef MEMFD_POOL_H
+#define MEMFD_POOL_H
+
+// Sealed memfd handoff. The sender fills a memfd, trims it to the
+// message, seals it with F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW and
+// passes the fd on. The receiver checks the seals with F_GET_SEALS:
+// once they are in place nobody, the sender included, can change the
+// contents or the size again, so the receiver can use its mapping in
+// place instead of copying the message out first.
+//
+// Seals cannot be removed, so a sealed memfd is never written again and
+// the buffers cannot be reused for the next message. What makes a memfd
+// expensive is everything before the first write: memfd_create, the
+// shmem allocation and the page faults of the mapping. The pool does
+// that ahead of time, off the hot path: it keeps a stock of
+// allocated, mapped and populated memfds and a thread tops it up as
+// buffers are taken. Handing off a message is then a copy into
+// populated memory, munmap (F_SEAL_WRITE fails with EBUSY while a
+// writable shared mapping exists), ftruncate and fcntl.
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
+
+#define MEMFD_SEALS (F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW)
+
+struct memfd_buf {
+  int fd;
+  char* map;
+  uint64_t size;
+};
+
+struct memfd_pool {
+  uint64_t size;
+  int capacity;
+  // Ready buffers, a ring of `count` entries from `first`.
+  struct memfd_buf* bufs;
+  int first;
+  int count;
+  int stop;
+  // errno of the refill thread's last failed memfd_buf_create, 0 after
+  // a successful one.
+  int error;
+  pthread_mutex_t lock;
+  pthread_cond_t taken;
+  pthread_cond_t refilled;
+  pthread_t refill;
+};
+
+// A sealable memfd of `size` bytes, allocated and mapped populated.
+static inline int memfd_buf_create(struct memfd_buf* buf, uint64_t size) {
+  buf->fd = syscall(SYS_memfd_create, "memfd_buf", MFD_ALLOW_SEALING | MFD_CLOEXEC);
+  if (buf->fd < 0)
+    return -1;
+  buf->map = MAP_FAILED;
+  if (fallocate(buf->fd, 0, 0, size) == 0)
+    buf->map = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, buf->fd, 0);
+  if (buf->map == MAP_FAILED) {
+    int err = errno;
+    close(buf->fd);
+    errno = err;
+    return -1;
+  }
+  buf->size = size;
+  return 0;
+}
+
+// Drop our mapping, trim the memfd to the first `len` bytes and seal
+// it. The fd is ready to be sent, the buffer must not be used again.
+static inline int memfd_buf_seal(struct memfd_buf* buf, uint64_t len) {
+  munmap(buf->map, buf->size);
+  buf->map = NULL;
+  if (len < buf->size && ftruncate(buf->fd, len) < 0)
+    return -1;
+  buf->size = len;
+  return fcntl(buf->fd, F_ADD_SEALS, MEMFD_SEALS);
+}
+
+// Receiver: 0 when `fd` carries all of MEMFD_SEALS, -1 with errno EPERM
+// (or the fcntl error) otherwise.
+static inline int memfd_check_seals(int fd) {
+  int seals = fcntl(fd, F_GET_SEALS);
+  if (seals < 0)
+    return -1;
+  if ((seals & MEMFD_SEALS) != MEMFD_SEALS) {
+    errno = EPERM;
+    return -1;
+  }
+  return 0;
+}
+
+static void* memfd_pool_refill(void* arg) {
+  struct memfd_pool* pool = (struct memfd_pool*)arg;
+  pthread_mutex_lock(&pool->lock);
+  while (!pool->stop) {
+    if (pool->count == pool->capacity) {
+      pthread_cond_wait(&pool->taken, &pool->lock);
+      continue;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    struct memfd_buf buf;
+    int r = memfd_buf_create(&buf, pool->size);
+    pthread_mutex_lock(&pool->lock);
+    if (r < 0) {
+      // Out of memory or fds: wake takers waiting on an empty pool so
+      // they create their own buffer, and try again in a while.
+      pool->error = errno;
+      pthread_cond_broadcast(&pool->refilled);
+      struct timespec until;
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_nsec += 10 * 1000 * 1000;
+      if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&pool->taken, &pool->lock, &until);
+      continue;
+    }
+    pool->error = 0;
+    pool->bufs[(pool->first + pool->count) % pool->capacity] = buf;
+    pool->count++;
+    pthread_cond_signal(&pool->refilled);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+// Create `capacity` buffers of `size` bytes up front and start the
+// thread that keeps the pool full. Returns 0, or -1 with errno set.
+static inline int memfd_pool_init(struct memfd_pool* pool, uint64_t size, int capacity) {
+  if (capacity < 1) {
+    errno = EINVAL;
+    return -1;
+  }
+  pool->size = size;
+  pool->capacity = capacity;
+  pool->bufs = (struct memfd_buf*)calloc(capacity, sizeof(struct memfd_buf));
+  if (!pool->bufs)
+    return -1;
+  pool->first = 0;
+  pool->count = 0;
+  pool->stop = 0;
+  pool->error = 0;
+  for (; pool->count < capacity; pool->count++) {
+    if (memfd_buf_create(&pool->bufs[pool->count], size) < 0)
+      break;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->taken, NULL);
+  pthread_cond_init(&pool->refilled, NULL);
+  if (pool->count < capacity || pthread_create(&pool->refill, NULL, memfd_pool_refill, pool) != 0) {
+    int err = errno;
+    for (int i = 0; i < pool->count; i++) {
+      munmap(pool->bufs[i].map, size);
+      close(pool->bufs[i].fd);
+    }
+    free(pool->bufs);
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+// Take a ready buffer, waiting for the refill thread when the pool ran
+// dry. When the refill thread is failing, the buffer is created here
+// instead. The buffer is the caller's now: seal and send it, or close
+// it. Returns 0, or -1 with errno set when no buffer could be had.
+static inline int memfd_pool_get(struct memfd_pool* pool, struct memfd_buf* buf) {
+  pthread_mutex_lock(&pool->lock);
+  while (pool->count == 0 && !pool->error)
+    pthread_cond_wait(&pool->refilled, &pool->lock);
+  if (pool->count == 0) {
+    pthread_mutex_unlock(&pool->lock);
+    return memfd_buf_create(buf, pool->size);
+  }
+  *buf = pool->bufs[pool->first];
+  pool->first = (pool->first + 1) % pool->capacity;
+  pool->count--;
+  pthread_cond_signal(&pool->taken);
+  pthread_mutex_unlock(&pool->lock);
+  return 0;
+}
+
+static inline void memfd_pool_destroy(struct memfd_pool* pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_signal(&pool->taken);
+  pthread_mutex_unlock(&pool->lock);
+  pthread_join(pool->refill, NULL);
+  for (int i = 0; i < pool->count; i++) {
+    struct memfd_buf* buf = &pool->bufs[(pool->first + i) % pool->capacity];
+    munmap(buf->map, buf->size);
+    close(buf->fd);
+  }
+  free(pool->bufs);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->taken);
+  pthread_cond_destroy(&pool->refilled);
+}
+
+#endif
@@ -0,0 +1,271 @@
+#ifndef SHM_BUS_H
+#define SHM_BUS_H
+
+// Multi producer, multi consumer message bus in shared memory (a memfd
+// mapped MAP_SHARED by every process). Every consumer sees every
+// message, in the same order, without a broker process in between.
+//
+// The header is followed by one cursor per consumer, each on its own
+// cache line, and a power of two number of fixed size slots. Message n
+// goes into slot n & mask.
+//
+// Producers claim message numbers with a CAS on `claim`, so any number
+// of them share the bus without a lock. A claim only succeeds while its
+// slot is free, i.e. every active consumer has moved past the message
+// that used the slot one lap earlier. Producers cache the slowest
+// cursor and only scan the cursors again when the cached one says the
+// bus is full. A producer fills its slot and publishes it with a
+// release store of the message number + 1 into the slot. Producers may
+// publish out of order, consumers stop at the first unpublished slot.
+//
+// Each consumer owns a cursor: the number of the next message it reads.
+// It reads a slot once the slot carries that number (acquire) and frees
+// it by advancing its cursor (release). Consumers never wait for each
+// other, only the slowest one holds producers back.
+//
+// The number of consumers is fixed when the bus is created, the creator
+// hands every consumer its index along with the memfd. A consumer that
+// quits calls shm_bus_leave(), so producers stop waiting for it.
+//
+// Two doorbells (common/doorbell.h) let either side sleep: producers
+// ring `data` after every message, consumers ring `space` every quarter
+// lap, which is often enough for a producer waiting on a full bus.
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "doorbell.h"
+
+#define SHM_BUS_MAGIC 0x53554253  // "SBUS"
+#define SHM_BUS_VERSION 1
+#define SHM_BUS_MAX_CONSUMERS 64
+
+struct shm_bus_cursor {
+  uint64_t next;
+  uint32_t active;
+} __attribute__((aligned(64)));
+
+struct shm_bus_slot {
+  // Message number + 1 once published, 0 before the first lap.
+  uint64_t seq;
+  uint32_t len;
+  uint32_t reserved;
+  char data[];
+};
+
+struct shm_bus_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slots;
+  uint32_t slot_size;
+  uint32_t consumers;
+  struct doorbell data;
+  struct doorbell space;
+  uint64_t claim __attribute__((aligned(64)));
+  struct shm_bus_cursor cursors[SHM_BUS_MAX_CONSUMERS];
+  char slot_area[] __attribute__((aligned(64)));
+};
+
+// Process local view of a bus. `consumer` is -1 for producers, which
+// cache the slowest cursor they saw.
+struct shm_bus {
+  struct shm_bus_header* hdr;
+  uint64_t mask;
+  int consumer;
+  uint64_t cached_min;
+};
+
+// Slots take the message plus the slot header, rounded up to a cache line.
+static inline uint64_t shm_bus_slot_size(uint64_t max_message) {
+  return (sizeof(struct shm_bus_slot) + max_message + 63) & ~63ul;
+}
+
+// Bytes a bus of `slots` messages of up to `max_message` bytes takes.
+static inline uint64_t shm_bus_size(uint64_t slots, uint64_t max_message) {
+  return sizeof(struct shm_bus_header) + slots * shm_bus_slot_size(max_message);
+}
+
+static inline struct shm_bus_slot* shm_bus_slot(struct shm_bus* b, uint64_t n) {
+  return (struct shm_bus_slot*)(b->hdr->slot_area + (n & b->mask) * b->hdr->slot_size);
+}
+
+// Format shm_bus_size() bytes at `mem` as an empty bus with `consumers`
+// active consumers and attach to it as a producer. `slots` is a power
+// of two, at least 4.
+static inline int shm_bus_init(struct shm_bus* b, void* mem, uint64_t slots, uint64_t max_message,
+                               int consumers) {
+  if (slots < 4 || (slots & (slots - 1)) || consumers < 1 || consumers > SHM_BUS_MAX_CONSUMERS) {
+    errno = EINVAL;
+    return -1;
+  }
+  struct shm_bus_header* hdr = (struct shm_bus_header*)mem;
+  memset(hdr, 0, sizeof(*hdr));
+  hdr->slots = slots;
+  hdr->slot_size = shm_bus_slot_size(max_message);
+  hdr->consumers = consumers;
+  for (int i = 0; i < consumers; i++)
+    hdr->cursors[i].active = 1;
+  // Slots of a fresh memfd read as zeroes: nothing published.
+  memset(hdr->slot_area, 0, slots * hdr->slot_size);
+  hdr->version = SHM_BUS_VERSION;
+  __atomic_store_n(&hdr->magic, SHM_BUS_MAGIC, __ATOMIC_RELEASE);
+  b->hdr = hdr;
+  b->mask = slots - 1;
+  b->consumer = -1;
+  b->cached_min = 0;
+  return 0;
+}
+
+// Attach to a bus formatted by another process, as consumer number
+// `consumer` or as a producer with -1.
+static inline int shm_bus_attach(struct shm_bus* b, void* mem, int consumer) {
+  struct shm_bus_header* hdr = (struct shm_bus_header*)mem;
+  if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHM_BUS_MAGIC ||
+      hdr->version != SHM_BUS_VERSION) {
+    errno = EPROTO;
+    return -1;
+  }
+  if (consumer >= (int)hdr->consumers) {
+    errno = EINVAL;
+    return -1;
+  }
+  b->hdr = hdr;
+  b->mask = hdr->slots - 1;
+  b->consumer = consumer;
+  b->cached_min = 0;
+  return 0;
+}
+
+static inline uint64_t shm_bus_max_message(struct shm_bus* b) {
+  return b->hdr->slot_size - sizeof(struct shm_bus_slot);
+}
+
+// Slowest active cursor, or `claim` when no consumer is left.
+static inline uint64_t shm_bus_min_cursor(struct shm_bus* b, uint64_t claim) {
+  struct shm_bus_header* hdr = b->hdr;
+  uint64_t min = claim;
+  for (uint32_t i = 0; i < hdr->consumers; i++) {
+    if (!__atomic_load_n(&hdr->cursors[i].active, __ATOMIC_ACQUIRE))
+      continue;
+    uint64_t next = __atomic_load_n(&hdr->cursors[i].next, __ATOMIC_ACQUIRE);
+    if (next < min)
+      min = next;
+  }
+  return min;
+}
+
+// Producer: claim the next message number and return its slot to fill
+// in, or NULL when the bus is full (EAGAIN) or the message can never
+// fit (EMSGSIZE). Publish it with shm_bus_publish().
+static inline void* shm_bus_claim(struct shm_bus* b, uint64_t len, uint64_t* n) {
+  if (len > shm_bus_max_message(b)) {
+    errno = EMSGSIZE;
+    return NULL;
+  }
+  struct shm_bus_header* hdr = b->hdr;
+  uint64_t claim = __atomic_load_n(&hdr->claim, __ATOMIC_RELAXED);
+  do {
+    if (claim - b->cached_min >= hdr->slots) {
+      b->cached_min = shm_bus_min_cursor(b, claim);
+      if (claim - b->cached_min >= hdr->slots) {
+        errno = EAGAIN;
+        return NULL;
+      }
+    }
+  } while (!__atomic_compare_exchange_n(&hdr->claim, &claim, claim + 1, 1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED));
+  *n = claim;
+  struct shm_bus_slot* slot = shm_bus_slot(b, claim);
+  slot->len = len;
+  return slot->data;
+}
+
+// Producer: publish message `n` returned by shm_bus_claim().
+static inline void shm_bus_publish(struct shm_bus* b, uint64_t n) {
+  __atomic_store_n(&shm_bus_slot(b, n)->seq, n + 1, __ATOMIC_RELEASE);
+  doorbell_ring(&b->hdr->data);
+}
+
+// Producer: copy `len` bytes in as one message. -1 with errno as for
+// shm_bus_claim().
+static inline int shm_bus_send(struct shm_bus* b, const void* buf, uint64_t len) {
+  uint64_t n;
+  void* dst = shm_bus_claim(b, len, &n);
+  if (!dst)
+    return -1;
+  memcpy(dst, buf, len);
+  shm_bus_publish(b, n);
+  return 0;
+}
+
+// Consumer: the next message and its length, or NULL when it is not
+// published yet. It stays valid until shm_bus_release().
+static inline const void* shm_bus_peek(struct shm_bus* b, uint64_t* len) {
+  uint64_t next = __atomic_load_n(&b->hdr->cursors[b->consumer].next, __ATOMIC_RELAXED);
+  struct shm_bus_slot* slot = shm_bus_slot(b, next);
+  if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != next + 1)
+    return NULL;
+  *len = slot->len;
+  return slot->data;
+}
+
+// Consumer: move past the message returned by the last shm_bus_peek().
+static inline void shm_bus_release(struct shm_bus* b) {
+  struct shm_bus_header* hdr = b->hdr;
+  uint64_t* cursor = &hdr->cursors[b->consumer].next;
+  uint64_t next = __atomic_load_n(cursor, __ATOMIC_RELAXED) + 1;
+  __atomic_store_n(cursor, next, __ATOMIC_RELEASE);
+  if ((next & (hdr->slots / 4 - 1)) == 0)
+    doorbell_ring(&hdr->space);
+}
+
+// Consumer: copy the next message out. Its length, or -1 with errno
+// EAGAIN when there is none yet or EMSGSIZE when it is longer than
+// `size` (it stays on the bus).
+static inline int64_t shm_bus_recv(struct shm_bus* b, void* buf, uint64_t size) {
+  uint64_t len;
+  const void* src = shm_bus_peek(b, &len);
+  if (!src) {
+    errno = EAGAIN;
+    return -1;
+  }
+  if (len > size) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  memcpy(buf, src, len);
+  shm_bus_release(b);
+  return len;
+}
+
+// Consumer: stop reading. Producers no longer wait for this cursor.
+static inline void shm_bus_leave(struct shm_bus* b) {
+  __atomic_store_n(&b->hdr->cursors[b->consumer].active, 0, __ATOMIC_RELEASE);
+  doorbell_ring(&b->hdr->space);
+}
+
+// Blocking send and receive: sleep on the doorbells while the bus is
+// full or empty.
+static inline int shm_bus_send_wait(struct shm_bus* b, const void* buf, uint64_t len) {
+  for (;;) {
+    uint32_t seen = doorbell_seq(&b->hdr->space);
+    if (shm_bus_send(b, buf, len) == 0)
+      return 0;
+    if (errno != EAGAIN)
+      return -1;
+    doorbell_wait(&b->hdr->space, seen, -1);
+  }
+}
+
+static inline int64_t shm_bus_recv_wait(struct shm_bus* b, void* buf, uint64_t size) {
+  for (;;) {
+    uint32_t seen = doorbell_seq(&b->hdr->data);
+    int64_t len = shm_bus_recv(b, buf, size);
+    if (len >= 0 || errno != EAGAIN)
+      return len;
+    doorbell_wait(&b->hdr->data, seen, -1);
+  }
+}
+
+#endif
@@ -0,0 +1,199 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+// Single producer, single consumer ring of variable length records,
+// laid out in shared memory (a memfd mapped MAP_SHARED by both
+// processes). The header holds the producer index (head) and the
+// consumer index (tail) on their own cache lines, followed by the data
+// area. Both indices count bytes and only grow, the offset into the
+// data area is the index masked by the capacity.
+//
+// A record is an 8 byte frame header (payload length) and the payload,
+// padded to 8 bytes. Records never wrap: when one does not fit before
+// the end of the data area, the producer writes a pad frame there and
+// the record starts over at offset 0. So the largest record is half
+// the capacity.
+//
+// The producer publishes records with a release store of head, the
+// consumer frees them with a release store of tail, each side reads
+// the other's index with an acquire load.
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SHM_RING_MAGIC 0x474e4952  // "RING"
+#define SHM_RING_VERSION 1
+#define SHM_RING_PAD 0xffffffffu
+
+struct shm_ring_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity;
+  uint64_t head __attribute__((aligned(64)));
+  uint64_t tail __attribute__((aligned(64)));
+  char data[] __attribute__((aligned(64)));
+};
+
+struct shm_ring_frame {
+  uint32_t len;
+  uint32_t reserved;
+};
+
+// Process local view of a ring. Each side also caches the last index
+// it saw of the other side, to touch the shared line only when the
+// ring looks full (producer) or empty (consumer).
+struct shm_ring {
+  struct shm_ring_header* hdr;
+  uint64_t mask;
+  uint64_t cached_tail;
+  uint64_t cached_head;
+};
+
+#define SHM_RING_ALIGN(n) (((n) + 7) & ~7ul)
+
+// Bytes a record of `len` bytes takes in the ring.
+static inline uint64_t shm_ring_record_size(uint64_t len) {
+  return sizeof(struct shm_ring_frame) + SHM_RING_ALIGN(len);
+}
+
+// Format `size` bytes at `mem` as an empty ring. The capacity is the
+// largest power of two that fits after the header.
+static inline int shm_ring_init(struct shm_ring* r, void* mem, uint64_t size) {
+  struct shm_ring_header* hdr = (struct shm_ring_header*)mem;
+  if (size < sizeof(*hdr) + 64) {
+    errno = EINVAL;
+    return -1;
+  }
+  uint64_t capacity = 1ul << (63 - __builtin_clzl(size - sizeof(*hdr)));
+  hdr->capacity = capacity;
+  hdr->head = 0;
+  hdr->tail = 0;
+  hdr->version = SHM_RING_VERSION;
+  __atomic_store_n(&hdr->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+  r->hdr = hdr;
+  r->mask = capacity - 1;
+  r->cached_tail = r->cached_head = 0;
+  return 0;
+}
+
+// Attach to a ring formatted by the other process.
+static inline int shm_ring_attach(struct shm_ring* r, void* mem) {
+  struct shm_ring_header* hdr = (struct shm_ring_header*)mem;
+  if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHM_RING_MAGIC ||
+      hdr->version != SHM_RING_VERSION) {
+    errno = EPROTO;
+    return -1;
+  }
+  r->hdr = hdr;
+  r->mask = hdr->capacity - 1;
+  r->cached_tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+  r->cached_head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+  return 0;
+}
+
+static inline uint64_t shm_ring_max_record(struct shm_ring* r) {
+  return r->hdr->capacity / 2 - sizeof(struct shm_ring_frame);
+}
+
+// Producer: room for a `len` byte record, or NULL when the ring is
+// full (EAGAIN) or the record can never fit (EMSGSIZE). Fill it in and
+// publish it with shm_ring_commit().
+static inline void* shm_ring_reserve(struct shm_ring* r, uint64_t len) {
+  if (len > shm_ring_max_record(r)) {
+    errno = EMSGSIZE;
+    return NULL;
+  }
+  struct shm_ring_header* hdr = r->hdr;
+  uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_RELAXED);
+  uint64_t off = head & r->mask;
+  uint64_t size = shm_ring_record_size(len);
+  uint64_t to_end = hdr->capacity - off;
+  uint64_t need = size > to_end ? to_end + size : size;
+  if (head + need - r->cached_tail > hdr->capacity) {
+    r->cached_tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+    if (head + need - r->cached_tail > hdr->capacity) {
+      errno = EAGAIN;
+      return NULL;
+    }
+  }
+  if (size > to_end) {
+    // Skip to the start: the consumer steps over the pad frame.
+    ((struct shm_ring_frame*)(hdr->data + off))->len = SHM_RING_PAD;
+    __atomic_store_n(&hdr->head, head + to_end, __ATOMIC_RELEASE);
+    off = 0;
+  }
+  struct shm_ring_frame* frame = (struct shm_ring_frame*)(hdr->data + off);
+  frame->len = len;
+  return frame + 1;
+}
+
+// Producer: publish the record returned by the last shm_ring_reserve().
+static inline void shm_ring_commit(struct shm_ring* r) {
+  struct shm_ring_header* hdr = r->hdr;
+  uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_RELAXED);
+  struct shm_ring_frame* frame = (struct shm_ring_frame*)(hdr->data + (head & r->mask));
+  __atomic_store_n(&hdr->head, head + shm_ring_record_size(frame->len), __ATOMIC_RELEASE);
+}
+
+// Producer: copy `len` bytes in as one record. -1 with errno as for
+// shm_ring_reserve().
+static inline int shm_ring_send(struct shm_ring* r, const void* buf, uint64_t len) {
+  void* dst = shm_ring_reserve(r, len);
+  if (!dst)
+    return -1;
+  memcpy(dst, buf, len);
+  shm_ring_commit(r);
+  return 0;
+}
+
+// Consumer: the oldest record and its length, or NULL when the ring is
+// empty. The record stays valid until shm_ring_release().
+static inline const void* shm_ring_peek(struct shm_ring* r, uint64_t* len) {
+  struct shm_ring_header* hdr = r->hdr;
+  uint64_t tail = __atomic_load_n(&hdr->tail, __ATOMIC_RELAXED);
+  for (;;) {
+    if (tail == r->cached_head) {
+      r->cached_head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+      if (tail == r->cached_head)
+        return NULL;
+    }
+    uint64_t off = tail & r->mask;
+    struct shm_ring_frame* frame = (struct shm_ring_frame*)(hdr->data + off);
+    if (frame->len != SHM_RING_PAD) {
+      *len = frame->len;
+      return frame + 1;
+    }
+    tail += hdr->capacity - off;
+    __atomic_store_n(&hdr->tail, tail, __ATOMIC_RELEASE);
+  }
+}
+
+// Consumer: free the record returned by the last shm_ring_peek().
+static inline void shm_ring_release(struct shm_ring* r) {
+  struct shm_ring_header* hdr = r->hdr;
+  uint64_t tail = __atomic_load_n(&hdr->tail, __ATOMIC_RELAXED);
+  struct shm_ring_frame* frame = (struct shm_ring_frame*)(hdr->data + (tail & r->mask));
+  __atomic_store_n(&hdr->tail, tail + shm_ring_record_size(frame->len), __ATOMIC_RELEASE);
+}
+
+// Consumer: copy the oldest record out. Its length, or -1 with errno
+// EAGAIN when the ring is empty or EMSGSIZE when it is longer than
+// `size` (it stays in the ring).
+static inline int64_t shm_ring_recv(struct shm_ring* r, void* buf, uint64_t size) {
+  uint64_t len;
+  const void* src = shm_ring_peek(r, &len);
+  if (!src) {
+    errno = EAGAIN;
+    return -1;
+  }
+  if (len > size) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  memcpy(buf, src, len);
+  shm_ring_release(r);
+  return len;
+}
+
+#endif
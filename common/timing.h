@@ -0,0 +1,153 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+// Latency measurement. timing_now() reads CLOCK_MONOTONIC_RAW in ns,
+// or the TSC when built with -DTIMING_TSC on x86_64, calibrated once
+// against CLOCK_MONOTONIC_RAW. Samples go into log-linear histograms:
+// every power of two is split into HIST_SUB_BUCKETS linear buckets,
+// so a percentile is off by at most 1/HIST_SUB_BUCKETS of its value,
+// recording is a few instructions and nothing is printed until the
+// end of the run.
+
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#if defined(TIMING_TSC) && defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB_BUCKETS)
+
+struct histogram {
+  const char* name;
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+  uint64_t buckets[HIST_BUCKETS];
+};
+
+static inline uint64_t clock_raw_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+#if defined(TIMING_TSC) && defined(__x86_64__)
+// TSC ticks per ns, measured over 10 ms on first use.
+static double tsc_per_ns = 0;
+
+static inline uint64_t timing_now() {
+  if (tsc_per_ns == 0) {
+    uint64_t ns = clock_raw_ns();
+    uint64_t tsc = __rdtsc();
+    usleep(10000);
+    tsc_per_ns = (double)(__rdtsc() - tsc) / (clock_raw_ns() - ns);
+  }
+  return __rdtsc() / tsc_per_ns;
+}
+#else
+static inline uint64_t timing_now() {
+  return clock_raw_ns();
+}
+#endif
+
+static inline void hist_init(struct histogram* h, const char* name) {
+  memset(h, 0, sizeof(*h));
+  h->name = name;
+  h->min = UINT64_MAX;
+}
+
+static inline int hist_index(uint64_t v) {
+  if (v < HIST_SUB_BUCKETS)
+    return v;
+  int exp = 63 - __builtin_clzl(v);
+  int sub = (v >> (exp - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1);
+  return (exp - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + sub;
+}
+
+// Largest value that lands in bucket `i`.
+static inline uint64_t hist_bucket_max(int i) {
+  if (i < HIST_SUB_BUCKETS)
+    return i;
+  int exp = i / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+  uint64_t sub = i % HIST_SUB_BUCKETS;
+  uint64_t width = 1ul << (exp - HIST_SUB_BITS);
+  return ((HIST_SUB_BUCKETS + sub) << (exp - HIST_SUB_BITS)) + width - 1;
+}
+
+static inline void hist_record(struct histogram* h, uint64_t ns) {
+  h->count++;
+  h->sum += ns;
+  if (ns < h->min)
+    h->min = ns;
+  if (ns > h->max)
+    h->max = ns;
+  h->buckets[hist_index(ns)]++;
+}
+
+// Add the samples of `src` to `dst`, e.g. per thread histograms.
+static inline void hist_merge(struct histogram* dst, struct histogram* src) {
+  dst->count += src->count;
+  dst->sum += src->sum;
+  if (src->min < dst->min)
+    dst->min = src->min;
+  if (src->max > dst->max)
+    dst->max = src->max;
+  for (int i = 0; i < HIST_BUCKETS; i++)
+    dst->buckets[i] += src->buckets[i];
+}
+
+// Time `fn` into histogram `h` and leave the duration in elapsed_ns.
+// Like LOG_TIME, declarations in `fn` stay visible after the macro.
+#define TIME_INTO(h, fn) \
+    uint64_t before_ns = timing_now(); \
+    fn; \
+    uint64_t elapsed_ns = timing_now() - before_ns; \
+    hist_record(&(h), elapsed_ns);
+
+// Value at percentile `p` (0-100), never above the largest sample.
+static inline uint64_t hist_percentile(struct histogram* h, double p) {
+  uint64_t rank = (uint64_t)(p / 100.0 * h->count + 0.5);
+  if (rank == 0)
+    rank = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      uint64_t v = hist_bucket_max(i);
+      return v < h->max ? v : h->max;
+    }
+  }
+  return h->max;
+}
+
+static inline void hist_format(char* buf, size_t len, uint64_t ns) {
+  if (ns < 10000)
+    snprintf(buf, len, "%"PRIu64" ns", ns);
+  else if (ns < 10000000)
+    snprintf(buf, len, "%.1f us", ns / 1e3);
+  else
+    snprintf(buf, len, "%.1f ms", ns / 1e6);
+}
+
+static inline void hist_print(struct histogram* h) {
+  if (!h->count) {
+    printf("%-24s no samples\n", h->name);
+    return;
+  }
+  char p50[32], p99[32], p999[32], max[32];
+  hist_format(p50, sizeof(p50), hist_percentile(h, 50));
+  hist_format(p99, sizeof(p99), hist_percentile(h, 99));
+  hist_format(p999, sizeof(p999), hist_percentile(h, 99.9));
+  hist_format(max, sizeof(max), h->max);
+  printf("%-24s n=%-8"PRIu64" p50=%-10s p99=%-10s p99.9=%-10s max=%s\n",
+         h->name, h->count, p50, p99, p999, max);
+}
+
+#endif
@@ -0,0 +1,190 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Binary fault tracing. printf on the fault path costs more than the
+// fault itself, so handlers append fixed size records to a per thread
+// ring instead and a separate thread decodes them to stdout. Every ring
+// has one producer (its thread) and one consumer (the drain thread):
+// head and tail live on their own cache lines, the producer publishes
+// a record with a release store of head and never waits. A full ring
+// drops the record and counts it.
+//
+// Build with -DTRACE=0 to compile tracing out entirely.
+
+#ifndef TRACE
+#define TRACE 1
+#endif
+
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+enum trace_event {
+  TRACE_POLL,      // flags: revents, result: poll() return value
+  TRACE_FAULT,     // addr: fault address, flags: pagefault flags
+  TRACE_COPY,      // addr: destination, result: bytes copied
+  TRACE_ZEROPAGE,  // addr: destination, result: bytes zeroed
+  TRACE_CONTINUE,  // addr: destination, result: bytes mapped
+  TRACE_BATCH,     // flags: faults in the batch, addr: poll/read calls
+                   // so far, result: faults so far
+};
+
+struct trace_record {
+  uint64_t ts;
+  uint64_t addr;
+  int64_t result;
+  int32_t fd;
+  uint16_t event;
+  uint16_t flags;
+};
+
+#if TRACE
+
+#define TRACE_RING_SIZE 4096  // records, power of two
+#define TRACE_MAX_RINGS 64
+#define TRACE_DRAIN_US 10000
+
+struct trace_ring {
+  // Producer side.
+  uint64_t head __attribute__((aligned(64)));
+  uint64_t cached_tail;
+  uint64_t dropped;
+  // Consumer side.
+  uint64_t tail __attribute__((aligned(64)));
+  struct trace_record records[TRACE_RING_SIZE] __attribute__((aligned(64)));
+};
+
+static struct trace_ring* trace_rings[TRACE_MAX_RINGS];
+static int trace_num_rings = 0;
+static __thread struct trace_ring* trace_self = NULL;
+static uint64_t trace_first_ts = 0;
+static volatile int trace_stopping = 0;
+static pthread_t trace_drainer;
+
+static inline uint64_t trace_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+// Called once per thread, on its first record.
+static struct trace_ring* trace_ring_new() {
+  int i = __atomic_fetch_add(&trace_num_rings, 1, __ATOMIC_RELAXED);
+  if (i >= TRACE_MAX_RINGS) {
+    printf("too many trace rings\n");
+    exit(EXIT_FAILURE);
+  }
+  struct trace_ring* r = aligned_alloc(64, sizeof(struct trace_ring));
+  r->head = r->cached_tail = r->dropped = r->tail = 0;
+  __atomic_store_n(&trace_rings[i], r, __ATOMIC_RELEASE);
+  trace_self = r;
+  return r;
+}
+
+static inline void trace(enum trace_event event, int fd, uint64_t addr, uint16_t flags,
+                         int64_t result) {
+  struct trace_ring* r = trace_self ? trace_self : trace_ring_new();
+  uint64_t head = r->head;
+  if (head - r->cached_tail == TRACE_RING_SIZE) {
+    r->cached_tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (head - r->cached_tail == TRACE_RING_SIZE) {
+      r->dropped++;
+      return;
+    }
+  }
+  struct trace_record* rec = &r->records[head & (TRACE_RING_SIZE - 1)];
+  rec->ts = trace_now();
+  rec->addr = addr;
+  rec->result = result;
+  rec->fd = fd;
+  rec->event = event;
+  rec->flags = flags;
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Times are relative to the first record decoded. Rings are drained one
+// after the other, so a record from a later ring may be older than that
+// and shows a negative time.
+static void trace_print(int ring, struct trace_record* rec) {
+  if (!trace_first_ts)
+    trace_first_ts = rec->ts;
+  printf("[%d %10.3f us] ", ring, (int64_t)(rec->ts - trace_first_ts) / 1000.0);
+  switch (rec->event) {
+    case TRACE_POLL:
+      printf("poll fd %d: nready = %"PRId64"; POLLIN = %d; POLLERR = %d\n", rec->fd,
+             rec->result, (rec->flags & 0x1) != 0, (rec->flags & 0x8) != 0);
+      break;
+    case TRACE_FAULT:
+      printf("fault fd %d: flags = %x; address = %"PRIx64"\n", rec->fd, rec->flags, rec->addr);
+      break;
+    case TRACE_COPY:
+    case TRACE_ZEROPAGE:
+    case TRACE_CONTINUE: {
+      static const char* names[] = { "UFFDIO_COPY", "UFFDIO_ZEROPAGE", "UFFDIO_CONTINUE" };
+      printf("%s fd %d: address = %"PRIx64"; returned %"PRId64"\n",
+             names[rec->event - TRACE_COPY], rec->fd, rec->addr, rec->result);
+      break;
+    }
+    case TRACE_BATCH:
+      printf("batch fd %d: %d faults; %.2f poll/read syscalls per fault (unbatched: 2.00)\n",
+             rec->fd, rec->flags, rec->result ? (double)rec->addr / rec->result : 0.0);
+      break;
+  }
+}
+
+// Decode everything published so far. Only the drain thread, or the
+// last thread standing, may call this.
+static void trace_drain() {
+  int n = __atomic_load_n(&trace_num_rings, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < n && i < TRACE_MAX_RINGS; i++) {
+    struct trace_ring* r = __atomic_load_n(&trace_rings[i], __ATOMIC_ACQUIRE);
+    if (!r)
+      continue;
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = r->tail;
+    for (; tail < head; tail++)
+      trace_print(i, &r->records[tail & (TRACE_RING_SIZE - 1)]);
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+  }
+  fflush(stdout);
+}
+
+static void* trace_drain_thread(void* arg) {
+  while (!trace_stopping) {
+    trace_drain();
+    usleep(TRACE_DRAIN_US);
+  }
+  return NULL;
+}
+
+static void trace_start() {
+  if (pthread_create(&trace_drainer, NULL, trace_drain_thread, NULL) != 0) {
+    printf("trace thread creation failed\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Stop the drain thread, decode what is left and report drops.
+static void trace_stop() {
+  trace_stopping = 1;
+  pthread_join(trace_drainer, NULL);
+  trace_drain();
+  for (int i = 0; i < trace_num_rings && i < TRACE_MAX_RINGS; i++)
+    if (trace_rings[i] && trace_rings[i]->dropped)
+      printf("trace ring %d: dropped %"PRIu64" records\n", i, trace_rings[i]->dropped);
+}
+
+#else
+
+static inline void trace(enum trace_event event, int fd, uint64_t addr, uint16_t flags,
+                         int64_t result) {}
+static inline void trace_start() {}
+static inline void trace_stop() {}
+
+#endif
+
+#endif
@@ -0,0 +1,253 @@
+#ifndef UFFD_SETUP_H
+#define UFFD_SETUP_H
+
+// Setup protocol between uffd clients and servers: a single message
+// carries every fd (memfd, uffds) in one SCM_RIGHTS control message and
+// a table describing the regions, and the receiver answers with an
+// explicit ack once it has taken them over. It runs over SOCK_SEQPACKET
+// connections, so messages keep their boundaries, both directions share
+// one connection and nobody has to bind a second socket for the reply.
+//
+// Message: header, then num_regions region entries. Regions and the
+// memfd refer to the fds by their index in the control message. The
+// ack carries 0 or the errno the receiver rejected the setup with, e.g.
+// EPROTONOSUPPORT for a version it does not speak.
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define UFFD_SETUP_MAGIC 0x50545355  // "USTP"
+#define UFFD_SETUP_VERSION 1
+#define UFFD_SETUP_MAX_FDS 128
+#define UFFD_SETUP_MAX_REGIONS 64
+
+struct uffd_setup_region {
+  // Address and length of the region in the sender's address space.
+  uint64_t start;
+  uint64_t len;
+  // Where the region starts in the memfd, when it maps one.
+  uint64_t memfd_offset;
+  uint32_t page_size;
+  // Index of the uffd the region is registered with, -1 for none.
+  int32_t uffd;
+};
+
+struct uffd_setup_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t num_regions;
+  uint32_t num_fds;
+  // Index of the memfd backing the regions, -1 for none.
+  int32_t memfd;
+};
+
+struct uffd_setup_ack {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t reserved;
+  int32_t status;
+};
+
+// One setup message, as built by the sender or unpacked by the receiver.
+struct uffd_setup {
+  struct uffd_setup_header hdr;
+  struct uffd_setup_region regions[UFFD_SETUP_MAX_REGIONS];
+  int fds[UFFD_SETUP_MAX_FDS];
+};
+
+static inline void uffd_setup_init(struct uffd_setup* s) {
+  memset(&s->hdr, 0, sizeof(s->hdr));
+  s->hdr.magic = UFFD_SETUP_MAGIC;
+  s->hdr.version = UFFD_SETUP_VERSION;
+  s->hdr.memfd = -1;
+}
+
+// Add an fd to the message, returns its index or -1 when full.
+static inline int uffd_setup_add_fd(struct uffd_setup* s, int fd) {
+  if (s->hdr.num_fds == UFFD_SETUP_MAX_FDS)
+    return -1;
+  s->fds[s->hdr.num_fds] = fd;
+  return s->hdr.num_fds++;
+}
+
+static inline int uffd_setup_add_region(struct uffd_setup* s, uint64_t start, uint64_t len,
+                                        uint64_t memfd_offset, uint32_t page_size, int uffd) {
+  if (s->hdr.num_regions == UFFD_SETUP_MAX_REGIONS)
+    return -1;
+  struct uffd_setup_region* r = &s->regions[s->hdr.num_regions];
+  r->start = start;
+  r->len = len;
+  r->memfd_offset = memfd_offset;
+  r->page_size = page_size;
+  r->uffd = uffd;
+  return s->hdr.num_regions++;
+}
+
+// Sun path address for `path`.
+static inline socklen_t uffd_setup_addr(struct sockaddr_un* addr, const char* path) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+  return sizeof(*addr);
+}
+
+// Listening socket at `path`, replacing a stale one. -1 with errno set.
+static inline int uffd_setup_listen(const char* path, int backlog) {
+  int sockfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sockfd < 0)
+    return -1;
+  struct sockaddr_un addr;
+  socklen_t len = uffd_setup_addr(&addr, path);
+  unlink(path);
+  if (bind(sockfd, (struct sockaddr*)&addr, len) < 0 || listen(sockfd, backlog) < 0) {
+    int err = errno;
+    close(sockfd);
+    errno = err;
+    return -1;
+  }
+  return sockfd;
+}
+
+static inline int uffd_setup_connect(const char* path) {
+  int sockfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sockfd < 0)
+    return -1;
+  struct sockaddr_un addr;
+  socklen_t len = uffd_setup_addr(&addr, path);
+  if (connect(sockfd, (struct sockaddr*)&addr, len) < 0) {
+    int err = errno;
+    close(sockfd);
+    errno = err;
+    return -1;
+  }
+  return sockfd;
+}
+
+static inline int uffd_setup_send(int sockfd, struct uffd_setup* s) {
+  struct iovec iov[2] = {
+    { .iov_base = &s->hdr, .iov_len = sizeof(s->hdr) },
+    { .iov_base = s->regions, .iov_len = s->hdr.num_regions * sizeof(struct uffd_setup_region) },
+  };
+  char buff[CMSG_SPACE(sizeof(int) * UFFD_SETUP_MAX_FDS)];
+  memset(buff, 0, sizeof(buff));
+  struct msghdr msg = {
+    .msg_name = 0,
+    .msg_namelen = 0,
+    .msg_iov = iov,
+    .msg_iovlen = 2,
+    .msg_control = s->hdr.num_fds ? buff : NULL,
+    .msg_controllen = s->hdr.num_fds ? CMSG_SPACE(sizeof(int) * s->hdr.num_fds) : 0,
+    .msg_flags = 0,
+  };
+  if (s->hdr.num_fds) {
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * s->hdr.num_fds);
+    memcpy(CMSG_DATA(cmsg), s->fds, sizeof(int) * s->hdr.num_fds);
+  }
+  return sendmsg(sockfd, &msg, 0) < 0 ? -1 : 0;
+}
+
+static inline void uffd_setup_close(struct uffd_setup* s) {
+  for (uint32_t i = 0; i < s->hdr.num_fds; i++)
+    close(s->fds[i]);
+  s->hdr.num_fds = 0;
+}
+
+// Receive and check one setup message. Returns 0, or -1 with errno:
+// ECONNRESET when the peer went away, EPROTO for a malformed message,
+// EPROTONOSUPPORT for another version. Any fds that came with a
+// rejected message are closed.
+static inline int uffd_setup_recv(int sockfd, struct uffd_setup* s) {
+  struct iovec iov[2] = {
+    { .iov_base = &s->hdr, .iov_len = sizeof(s->hdr) },
+    { .iov_base = s->regions, .iov_len = sizeof(s->regions) },
+  };
+  char buff[CMSG_SPACE(sizeof(int) * UFFD_SETUP_MAX_FDS)];
+  struct msghdr msg = {
+    .msg_name = 0,
+    .msg_namelen = 0,
+    .msg_iov = iov,
+    .msg_iovlen = 2,
+    .msg_control = buff,
+    .msg_controllen = sizeof(buff),
+    .msg_flags = 0,
+  };
+  ssize_t n = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+  if (n < 0)
+    return -1;
+  if (n == 0) {
+    errno = ECONNRESET;
+    return -1;
+  }
+
+  uint32_t nfds = 0;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+    nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(s->fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+  }
+  uint32_t sent_fds = s->hdr.num_fds;
+  s->hdr.num_fds = nfds;
+
+  int err = 0;
+  if (n < sizeof(s->hdr) || s->hdr.magic != UFFD_SETUP_MAGIC)
+    err = EPROTO;
+  else if (s->hdr.version != UFFD_SETUP_VERSION)
+    err = EPROTONOSUPPORT;
+  else if ((msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || sent_fds != nfds ||
+           n != sizeof(s->hdr) + s->hdr.num_regions * sizeof(struct uffd_setup_region) ||
+           s->hdr.memfd < -1 || s->hdr.memfd >= (int32_t)nfds)
+    err = EPROTO;
+  for (int i = 0; !err && i < s->hdr.num_regions; i++) {
+    if (s->regions[i].uffd < -1 || s->regions[i].uffd >= (int32_t)nfds)
+      err = EPROTO;
+  }
+  if (err) {
+    uffd_setup_close(s);
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+// Answer a setup message with 0 or an errno.
+static inline int uffd_setup_ack(int sockfd, int status) {
+  struct uffd_setup_ack ack = {
+    .magic = UFFD_SETUP_MAGIC,
+    .version = UFFD_SETUP_VERSION,
+    .reserved = 0,
+    .status = status,
+  };
+  return send(sockfd, &ack, sizeof(ack), 0) == sizeof(ack) ? 0 : -1;
+}
+
+// Wait for the ack of our setup message. 0 once accepted, -1 with the
+// receiver's errno when rejected (EPROTO for a malformed ack).
+static inline int uffd_setup_wait_ack(int sockfd) {
+  struct uffd_setup_ack ack;
+  ssize_t n = recv(sockfd, &ack, sizeof(ack), 0);
+  if (n < 0)
+    return -1;
+  if (n == 0) {
+    errno = ECONNRESET;
+    return -1;
+  }
+  if (n != sizeof(ack) || ack.magic != UFFD_SETUP_MAGIC) {
+    errno = EPROTO;
+    return -1;
+  }
+  if (ack.status) {
+    errno = ack.status;
+    return -1;
+  }
+  return 0;
+}
+
+#endif
@@ -0,0 +1,140 @@
+#ifndef ZERO_PAGE_H
+#define ZERO_PAGE_H
+
+// All-zero page detection. Snapshot pages that are all zeroes can be
+// resolved with UFFDIO_ZEROPAGE instead of being copied. The scanners
+// OR the data into an accumulator and only test it every
+// ZERO_SCAN_BLOCK bytes, so non-zero pages bail out early without a
+// branch per vector.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#define ZERO_SCAN_BLOCK 256
+
+typedef int (*is_zero_fn)(const char* data, uint64_t len);
+
+// `len` is a multiple of ZERO_SCAN_BLOCK for every scanner below,
+// which holds for any page size.
+static int is_zero_scalar(const char* data, uint64_t len) {
+  const uint64_t* p = (const uint64_t*)data;
+  for (uint64_t i = 0; i < len / 8; i += ZERO_SCAN_BLOCK / 8) {
+    uint64_t acc = 0;
+    for (int j = 0; j < ZERO_SCAN_BLOCK / 8; j++)
+      acc |= p[i + j];
+    if (acc)
+      return 0;
+  }
+  return 1;
+}
+
+#if defined(__x86_64__)
+static int is_zero_sse2(const char* data, uint64_t len) {
+  const __m128i* p = (const __m128i*)data;
+  for (uint64_t i = 0; i < len / 16; i += ZERO_SCAN_BLOCK / 16) {
+    __m128i acc = _mm_setzero_si128();
+    for (int j = 0; j < ZERO_SCAN_BLOCK / 16; j++)
+      acc = _mm_or_si128(acc, _mm_loadu_si128(p + i + j));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff)
+      return 0;
+  }
+  return 1;
+}
+
+__attribute__((target("avx2")))
+static int is_zero_avx2(const char* data, uint64_t len) {
+  const __m256i* p = (const __m256i*)data;
+  for (uint64_t i = 0; i < len / 32; i += ZERO_SCAN_BLOCK / 32) {
+    __m256i acc = _mm256_setzero_si256();
+    for (int j = 0; j < ZERO_SCAN_BLOCK / 32; j++)
+      acc = _mm256_or_si256(acc, _mm256_loadu_si256(p + i + j));
+    if (!_mm256_testz_si256(acc, acc))
+      return 0;
+  }
+  return 1;
+}
+#elif defined(__aarch64__)
+static int is_zero_neon(const char* data, uint64_t len) {
+  const uint8_t* p = (const uint8_t*)data;
+  for (uint64_t i = 0; i < len; i += ZERO_SCAN_BLOCK) {
+    uint8x16_t acc = vdupq_n_u8(0);
+    for (int j = 0; j < ZERO_SCAN_BLOCK; j += 16)
+      acc = vorrq_u8(acc, vld1q_u8(p + i + j));
+    if (vmaxvq_u8(acc))
+      return 0;
+  }
+  return 1;
+}
+#endif
+
+typedef struct {
+  is_zero_fn fn;
+  char* name;
+} ZeroScanner;
+
+static ZeroScanner zero_scanners[] = {
+  { .fn = is_zero_scalar, .name = "scalar" },
+#if defined(__x86_64__)
+  { .fn = is_zero_sse2, .name = "sse2" },
+  { .fn = is_zero_avx2, .name = "avx2" },
+#elif defined(__aarch64__)
+  { .fn = is_zero_neon, .name = "neon" },
+#endif
+};
+
+static int zero_scanner_supported(ZeroScanner* s) {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (s->fn == is_zero_avx2)
+    return __builtin_cpu_supports("avx2");
+#endif
+  return 1;
+}
+
+// Pick the scanner called `name`, or the widest one the CPU
+// supports if `name` is NULL.
+static ZeroScanner* zero_scanner(const char* name) {
+  int n = sizeof(zero_scanners) / sizeof(zero_scanners[0]);
+  ZeroScanner* best = &zero_scanners[0];
+  for (int i = 0; i < n; i++) {
+    if (!zero_scanner_supported(&zero_scanners[i]))
+      continue;
+    if (name && !strcmp(name, zero_scanners[i].name))
+      return &zero_scanners[i];
+    best = &zero_scanners[i];
+  }
+  if (name) {
+    printf("zero page scanner %s is not available\n", name);
+    exit(EXIT_FAILURE);
+  }
+  return best;
+}
+
+// Scan `size` bytes of `data` once and return a bitmap with one bit set
+// per all-zero page. A trailing partial page is never marked zero.
+static uint64_t* zero_page_bitmap(ZeroScanner* scanner, const char* data, uint64_t size,
+                                  uint64_t page_size, uint64_t* zero_pages) {
+  uint64_t pages = size / page_size;
+  uint64_t* bitmap = calloc((pages + 63) / 64, sizeof(uint64_t));
+  *zero_pages = 0;
+  for (uint64_t p = 0; p < pages; p++) {
+    if (scanner->fn(data + p * page_size, page_size)) {
+      bitmap[p / 64] |= 1ul << (p % 64);
+      (*zero_pages)++;
+    }
+  }
+  return bitmap;
+}
+
+static inline int zero_page_test(const uint64_t* bitmap, uint64_t page) {
+  return (bitmap[page / 64] >> (page % 64)) & 1;
+}
+
+#endif
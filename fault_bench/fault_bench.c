@@ -0,0 +1,482 @@
+#define _GNU_SOURCE
+#include <math.h>
+#include <poll.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
+#include <linux/userfaultfd.h>
+
+#include "../common/doorbell.h"
+#include "../common/timing.h"
+#include "../common/uffd_setup.h"
+
+// Page fault latency benchmark. Maps a uffd registered memfd region,
+// has it served by one of the topologies in this repo and touches it
+// from several threads in a given pattern. Every access is timed and
+// the run is reported as one JSON line on stdout, everything else goes
+// to stderr.
+//
+// Topologies:
+//   local         a handler thread in this process (local_memfd_uffd)
+//   uffd_for_all  the uffd_for_all server, started with -n 1 -s <pages>
+//   chained       takes the place of chained_uffd/back: the region is the
+//                 chained front's memfd and faults go through its proxy
+
+const int PAGE_SIZE = 4096;
+const char* SERVER_SOCKET_PATH = "test_socket";
+const char* UFFD_SOCKET_PATH = "test_socket_uffd";
+
+#define MAX_THREADS 64
+
+// Control page of the chained front's memfd, as in chained_uffd.
+struct control {
+  struct doorbell bound;
+  struct doorbell ready;
+  struct doorbell done;
+};
+
+enum pattern { SEQ, RANDOM, STRIDED, ZIPF };
+static const char* pattern_names[] = { "seq", "random", "strided", "zipf" };
+
+static const char* topology = "local";
+static uint64_t num_pages = 4096;
+static enum pattern pattern = SEQ;
+static int write_op = 0;
+static int num_threads = 1;
+static int stride = 16;
+static double zipf_s = 0.99;
+static uint64_t seed = 1;
+
+static char* region;
+static struct control* control;
+// Page visiting order for seq, random and strided, split into one
+// contiguous slice per thread. Zipf draws from zipf_cdf instead.
+static uint64_t* order;
+static double* zipf_cdf;
+static uint64_t* zipf_rank;
+static volatile int stop_handler = 0;
+static uint64_t handler_faults = 0;
+
+struct toucher {
+  int id;
+  pthread_t thread;
+  uint64_t first;
+  uint64_t count;
+  struct histogram hist;
+};
+
+// xorshift64*, one state per thread.
+static inline uint64_t next_rand(uint64_t* state) {
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545f4914f6cdd1dul;
+}
+
+void build_order() {
+  order = malloc(num_pages * sizeof(uint64_t));
+  if (pattern == STRIDED) {
+    // Every stride-th page, then the next offset, until all are seen.
+    uint64_t k = 0;
+    for (uint64_t off = 0; off < stride && off < num_pages; off++)
+      for (uint64_t p = off; p < num_pages; p += stride)
+        order[k++] = p;
+    return;
+  }
+
+  for (uint64_t p = 0; p < num_pages; p++)
+    order[p] = p;
+  if (pattern == RANDOM || pattern == ZIPF) {
+    uint64_t state = seed * 0x9e3779b97f4a7c15ul | 1;
+    for (uint64_t i = num_pages - 1; i > 0; i--) {
+      uint64_t j = next_rand(&state) % (i + 1);
+      uint64_t t = order[i];
+      order[i] = order[j];
+      order[j] = t;
+    }
+  }
+  if (pattern == ZIPF) {
+    // Rank r is page order[r], so the hot pages are spread over the
+    // region instead of sitting at its start.
+    zipf_rank = order;
+    zipf_cdf = malloc(num_pages * sizeof(double));
+    double sum = 0;
+    for (uint64_t r = 0; r < num_pages; r++) {
+      sum += 1.0 / pow(r + 1, zipf_s);
+      zipf_cdf[r] = sum;
+    }
+    for (uint64_t r = 0; r < num_pages; r++)
+      zipf_cdf[r] /= sum;
+  }
+}
+
+static inline uint64_t zipf_page(uint64_t* state) {
+  double u = (next_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+  uint64_t lo = 0, hi = num_pages - 1;
+  while (lo < hi) {
+    uint64_t mid = (lo + hi) / 2;
+    if (zipf_cdf[mid] < u)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return zipf_rank[lo];
+}
+
+void* touch_thread(void* arg) {
+  struct toucher* t = (struct toucher*)arg;
+  uint64_t state = (seed + t->id + 1) * 0x9e3779b97f4a7c15ul | 1;
+  volatile char sum = 0;
+  for (uint64_t i = 0; i < t->count; i++) {
+    uint64_t page = pattern == ZIPF ? zipf_page(&state) : order[t->first + i];
+    volatile char* ptr = region + page * PAGE_SIZE;
+    if (write_op) {
+      TIME_INTO(t->hist, *ptr = (char)i)
+    } else {
+      TIME_INTO(t->hist, sum += *ptr)
+    }
+  }
+  return NULL;
+}
+
+int connect_socket(int sockfd, const char* path) {
+  struct sockaddr_un server_addr;
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sun_family = AF_UNIX;
+  strncpy(server_addr.sun_path, path, sizeof(server_addr.sun_path) - 1);
+
+  if (connect(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+    perror("connect failed");
+    exit(EXIT_FAILURE);
+  }
+
+  return sockfd;
+}
+
+void send_fd_and_addr(int sockfd, int fd, uint64_t addr) {
+  struct iovec iov = {
+    .iov_base = &addr,
+    .iov_len = sizeof(uint64_t),
+  };
+  char buff[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg = {
+    .msg_name = 0,
+    .msg_namelen = 0,
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = &buff,
+    .msg_controllen = sizeof(buff),
+    .msg_flags = 0,
+  };
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  int* data = (int*)CMSG_DATA(cmsg);
+  memcpy(data, &fd, sizeof(int));
+
+  int r = sendmsg(sockfd, &msg, 0);
+  if (r < 0) {
+    perror("sending uffd fd");
+    exit(EXIT_FAILURE);
+  }
+}
+
+int get_fd(int sockfd) {
+  char iov_dummy;
+  struct iovec iov = {
+    .iov_base = &iov_dummy,
+    .iov_len = sizeof(char)
+  };
+  char buff[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg = {
+    .msg_name = 0,
+    .msg_namelen = 0,
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = &buff,
+    .msg_controllen = sizeof(buff),
+    .msg_flags = 0,
+  };
+
+  if (recvmsg(sockfd, &msg, 0) < 0) {
+    perror("recvmsg failed");
+    exit(EXIT_FAILURE);
+  }
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  return *(int*)CMSG_DATA(cmsg);
+}
+
+int create_uffd(char* map, uint64_t size, uint64_t features, uint64_t mode) {
+  int uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+  if (uffd < 0) {
+    perror("uffd creation failed");
+    exit(EXIT_FAILURE);
+  }
+
+  struct uffdio_api uffdio_api;
+  uffdio_api.api = UFFD_API;
+  uffdio_api.features = features;
+  if (ioctl(uffd, UFFDIO_API, &uffdio_api) == -1) {
+    perror("uffd_api failed");
+    exit(EXIT_FAILURE);
+  }
+
+  struct uffdio_register uffdio_register;
+  uffdio_register.range.start = (unsigned long) map;
+  uffdio_register.range.len = size;
+  uffdio_register.mode = mode;
+  if (ioctl(uffd, UFFDIO_REGISTER, &uffdio_register) == -1) {
+    perror("uffd_register failed");
+    exit(EXIT_FAILURE);
+  }
+  return uffd;
+}
+
+char* create_region(uint64_t size) {
+  int memfd = syscall(SYS_memfd_create, "fault_bench", 0);
+  if (memfd < 0) {
+    perror("memfd failed");
+    exit(EXIT_FAILURE);
+  }
+  if (ftruncate(memfd, size) < 0) {
+    perror("ftruncate failed");
+    exit(EXIT_FAILURE);
+  }
+  char* map = (char*)mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (map == MAP_FAILED) {
+    perror("memfd map failed");
+    exit(EXIT_FAILURE);
+  }
+  close(memfd);
+  return map;
+}
+
+// In process handler, as in local_memfd_uffd: drain the uffd and
+// resolve every fault with a UFFDIO_COPY of a filled page.
+void* local_handler(void* arg) {
+  int uffd = (int)(intptr_t)arg;
+  char* page = (char*)mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (page == MAP_FAILED) {
+    perror("uffd thread mmap failed");
+    exit(EXIT_FAILURE);
+  }
+  memset(page, 'A', PAGE_SIZE);
+
+  struct uffd_msg msgs[16];
+  while (!stop_handler) {
+    struct pollfd pollfd = { .fd = uffd, .events = POLLIN };
+    if (poll(&pollfd, 1, 100) <= 0)
+      continue;
+    int nread = read(uffd, msgs, sizeof(msgs));
+    if (nread == -1) {
+      if (errno == EAGAIN)
+        continue;
+      perror("uffd read failed");
+      exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < nread / sizeof(struct uffd_msg); i++) {
+      struct uffdio_copy uffdio_copy;
+      uffdio_copy.src = (unsigned long) page;
+      uffdio_copy.dst = (unsigned long) msgs[i].arg.pagefault.address & ~(PAGE_SIZE - 1);
+      uffdio_copy.len = PAGE_SIZE;
+      uffdio_copy.mode = 0;
+      uffdio_copy.copy = 0;
+      // EEXIST: another thread faulted the same page, already served.
+      if (ioctl(uffd, UFFDIO_COPY, &uffdio_copy) == -1 && errno != EEXIST) {
+        perror("UFFDIO_COPY");
+        exit(EXIT_FAILURE);
+      }
+      handler_faults++;
+    }
+  }
+  return NULL;
+}
+
+// Set up the region for the chosen topology.
+void setup_topology(pthread_t* handler) {
+  uint64_t size = num_pages * PAGE_SIZE;
+  if (!strcmp(topology, "local")) {
+    region = create_region(size);
+    int uffd = create_uffd(region, size, 0, UFFDIO_REGISTER_MODE_MISSING);
+    if (pthread_create(handler, NULL, local_handler, (void*)(intptr_t)uffd) != 0) {
+      fprintf(stderr, "handler thread creation failed\n");
+      exit(EXIT_FAILURE);
+    }
+  } else if (!strcmp(topology, "uffd_for_all")) {
+    region = create_region(size);
+    int uffd = create_uffd(region, size, 0, UFFDIO_REGISTER_MODE_MISSING);
+    // Faults are served once the server acked the setup.
+    int sockfd = uffd_setup_connect(UFFD_SOCKET_PATH);
+    struct uffd_setup setup;
+    uffd_setup_init(&setup);
+    int index = uffd_setup_add_fd(&setup, uffd);
+    uffd_setup_add_region(&setup, (uint64_t)region, size, 0, PAGE_SIZE, index);
+    if (sockfd < 0 || uffd_setup_send(sockfd, &setup) < 0 || uffd_setup_wait_ack(sockfd) < 0) {
+      perror("uffd server setup failed");
+      exit(EXIT_FAILURE);
+    }
+    close(sockfd);
+  } else if (!strcmp(topology, "chained")) {
+    // Same handshake as chained_uffd/back.
+    int sockfd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    struct sockaddr_un server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sun_family = AF_UNIX;
+    strncpy(server_addr.sun_path, SERVER_SOCKET_PATH, sizeof(server_addr.sun_path) - 1);
+    unlink(SERVER_SOCKET_PATH);
+    if (bind(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+      perror("bind failed");
+      exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "waiting for the chained front memfd\n");
+    int memfd = get_fd(sockfd);
+    struct stat st;
+    if (fstat(memfd, &st) < 0) {
+      perror("memfd fstat failed");
+      exit(EXIT_FAILURE);
+    }
+    // The last page is the control page.
+    num_pages = st.st_size / PAGE_SIZE - 1;
+    size = num_pages * PAGE_SIZE;
+    region = (char*)mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (region == MAP_FAILED) {
+      perror("memfd map failed");
+      exit(EXIT_FAILURE);
+    }
+    control = (struct control*)mmap(0, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, size);
+    if (control == MAP_FAILED) {
+      perror("control map failed");
+      exit(EXIT_FAILURE);
+    }
+    int uffd = create_uffd(region, size, UFFD_FEATURE_MINOR_SHMEM,
+                           UFFDIO_REGISTER_MODE_MISSING | UFFDIO_REGISTER_MODE_MINOR);
+    // Front unlinks the socket and binds it again after sending the
+    // memfd, connecting before that would connect us to ourselves.
+    if (doorbell_wait(&control->bound, 0, 10000) < 0) {
+      perror("front did not bind its socket");
+      exit(EXIT_FAILURE);
+    }
+    connect_socket(sockfd, SERVER_SOCKET_PATH);
+    send_fd_and_addr(sockfd, uffd, (uint64_t)region);
+    // Meanwhile front registers its own uffd with the uffd server.
+    if (doorbell_wait(&control->ready, 0, 10000) < 0) {
+      perror("front did not register with the uffd server");
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    fprintf(stderr, "unknown topology %s\n", topology);
+    exit(EXIT_FAILURE);
+  }
+}
+
+void usage(const char* name) {
+  fprintf(stderr, "Usage: %s [-T topology] [-s pages] [-a pattern] [-w] [-t threads]"
+          " [-S stride] [-z skew] [-r seed]\n", name);
+  fprintf(stderr, "  -T  local, uffd_for_all or chained (default %s)\n", topology);
+  fprintf(stderr, "  -s  region size in 4 KiB pages (default %"PRIu64", chained: the front memfd size)\n",
+          num_pages);
+  fprintf(stderr, "  -a  access pattern: seq, random, strided or zipf (default seq)\n");
+  fprintf(stderr, "  -w  write to the pages instead of reading them\n");
+  fprintf(stderr, "  -t  faulting threads (default %d, max %d)\n", num_threads, MAX_THREADS);
+  fprintf(stderr, "  -S  stride in pages for -a strided (default %d)\n", stride);
+  fprintf(stderr, "  -z  zipf skew for -a zipf (default %.2f)\n", zipf_s);
+  fprintf(stderr, "  -r  random seed (default %"PRIu64")\n", seed);
+}
+
+int main(int argc, char** argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "T:s:a:wt:S:z:r:h")) != -1) {
+    switch (opt) {
+      case 'T': topology = optarg; break;
+      case 's': num_pages = strtoull(optarg, NULL, 0); break;
+      case 'a':
+        for (pattern = SEQ; pattern <= ZIPF; pattern++)
+          if (!strcmp(optarg, pattern_names[pattern]))
+            break;
+        if (pattern > ZIPF) {
+          usage(argv[0]);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'w': write_op = 1; break;
+      case 't': num_threads = atoi(optarg); break;
+      case 'S': stride = atoi(optarg); break;
+      case 'z': zipf_s = atof(optarg); break;
+      case 'r': seed = strtoull(optarg, NULL, 0); break;
+      default: usage(argv[0]); exit(EXIT_FAILURE);
+    }
+  }
+  if (num_pages < 1 || num_threads < 1 || num_threads > MAX_THREADS || stride < 1) {
+    usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_t handler;
+  setup_topology(&handler);
+  build_order();
+  fprintf(stderr, "%s: %"PRIu64" pages, %s %s, %d threads\n", topology, num_pages,
+          pattern_names[pattern], write_op ? "write" : "read", num_threads);
+
+  // Zipf: every thread draws num_pages / num_threads accesses, hot
+  // pages are hit many times and fault only once.
+  static struct toucher touchers[MAX_THREADS];
+  uint64_t slice = num_pages / num_threads;
+  for (int i = 0; i < num_threads; i++) {
+    touchers[i].id = i;
+    touchers[i].first = i * slice;
+    touchers[i].count = i == num_threads - 1 ? num_pages - i * slice : slice;
+    hist_init(&touchers[i].hist, "access");
+  }
+
+  uint64_t before = timing_now();
+  for (int i = 0; i < num_threads; i++) {
+    if (pthread_create(&touchers[i].thread, NULL, touch_thread, &touchers[i]) != 0) {
+      fprintf(stderr, "thread creation failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (int i = 0; i < num_threads; i++)
+    pthread_join(touchers[i].thread, NULL);
+  uint64_t elapsed = timing_now() - before;
+
+  struct histogram all;
+  hist_init(&all, "access");
+  for (int i = 0; i < num_threads; i++)
+    hist_merge(&all, &touchers[i].hist);
+
+  if (!strcmp(topology, "local")) {
+    stop_handler = 1;
+    pthread_join(handler, NULL);
+    fprintf(stderr, "local handler: %"PRIu64" faults served\n", handler_faults);
+  } else if (!strcmp(topology, "chained")) {
+    doorbell_ring(&control->done);
+  }
+
+  printf("{\"topology\": \"%s\", \"pages\": %"PRIu64", \"page_size\": %d, "
+         "\"pattern\": \"%s\", \"op\": \"%s\", \"threads\": %d, \"accesses\": %"PRIu64", "
+         "\"elapsed_us\": %"PRIu64", \"accesses_per_s\": %.0f, \"mean_ns\": %"PRIu64", "
+         "\"p50_ns\": %"PRIu64", \"p99_ns\": %"PRIu64", \"p999_ns\": %"PRIu64", "
+         "\"max_ns\": %"PRIu64"}\n",
+         topology, num_pages, PAGE_SIZE, pattern_names[pattern], write_op ? "write" : "read",
+         num_threads, all.count, elapsed / 1000, all.count * 1e9 / elapsed,
+         all.sum / all.count, hist_percentile(&all, 50), hist_percentile(&all, 99),
+         hist_percentile(&all, 99.9), all.max);
+  return 0;
+}
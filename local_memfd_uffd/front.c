@@ -2,6 +2,7 @@
 #include <poll.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <inttypes.h>
@@ -15,10 +16,18 @@
 #include <linux/memfd.h>
 #include <linux/userfaultfd.h>
 
+#include "../common/trace.h"
+
 static int PAGE_SIZE = 4096;
 static int SIZE = 8192;
 static char* SERVER_SOCKET_PATH = "test_socket";
 
+/* Max number of messages drained from the uffd with one read().
+   Build with -DMSGS_PER_READ=1 to read a single message per call. */
+#ifndef MSGS_PER_READ
+#define MSGS_PER_READ 16
+#endif
+
 void* fault_handler_thread(void *arg) {
   printf("Running uffd thread\n");
   int uffd = (int)arg;
@@ -33,74 +42,91 @@ void* fault_handler_thread(void *arg) {
   /* Loop, handling incoming events on the userfaultfd
      file descriptor. */
   int fault_cnt = 0; /* Number of faults so far handled */
+  unsigned long syscalls = 0; /* poll() and read() calls so far */
+  struct uffd_msg msgs[MSGS_PER_READ]; /* Data read from userfaultfd */
   for (;;) {
       /* See what poll() tells us about the userfaultfd. */
       struct pollfd pollfd;
       pollfd.fd = uffd;
       pollfd.events = POLLIN;
       int nready = poll(&pollfd, 1, -1);
+      syscalls++;
       if (nready == -1) {
         printf("poll failed\n");
         exit(EXIT_FAILURE);
       }
 
-      printf("\nfault_handler_thread():\n");
-      printf("    poll() returns: nready = %d; "
-             "POLLIN = %d; POLLERR = %d\n", nready,
-             (pollfd.revents & POLLIN) != 0,
-             (pollfd.revents & POLLERR) != 0);
-
-      /* Read an event from the userfaultfd. */
-
-      struct uffd_msg msg;  /* Data read from userfaultfd */
-      int nread = read(uffd, &msg, sizeof(msg));
-      if (nread == 0) {
-          printf("EOF on userfaultfd!\n");
-          exit(EXIT_FAILURE);
-      }
-
-      if (nread == -1){
-        printf("uffd thread read failed\n");
-        exit(EXIT_FAILURE);
-      }
-
-      /* We expect only one kind of event; verify that assumption. */
-
-      if (msg.event != UFFD_EVENT_PAGEFAULT) {
-          printf("Unexpected event on userfaultfd\n");
-          exit(EXIT_FAILURE);
+      trace(TRACE_POLL, uffd, 0, pollfd.revents, nready);
+
+      /* Drain the userfaultfd, reading up to MSGS_PER_READ events
+         per read(), and resolve the whole batch before going
+         back to poll(). */
+      int batch_faults = 0;
+      for (;;) {
+          int nread = read(uffd, msgs, sizeof(msgs));
+          syscalls++;
+          if (nread == 0) {
+              printf("EOF on userfaultfd!\n");
+              exit(EXIT_FAILURE);
+          }
+
+          if (nread == -1) {
+            if (errno == EAGAIN)
+              break;
+            printf("uffd thread read failed\n");
+            exit(EXIT_FAILURE);
+          }
+
+          int nmsgs = nread / sizeof(struct uffd_msg);
+          for (int i = 0; i < nmsgs; i++) {
+              struct uffd_msg* msg = &msgs[i];
+
+              /* We expect only one kind of event; verify that assumption. */
+
+              if (msg->event != UFFD_EVENT_PAGEFAULT) {
+                  printf("Unexpected event on userfaultfd\n");
+                  exit(EXIT_FAILURE);
+              }
+
+              /* Record the page-fault event, decoded off this thread. */
+
+              trace(TRACE_FAULT, uffd, msg->arg.pagefault.address,
+                    msg->arg.pagefault.flags, 0);
+
+              /* Copy the page pointed to by 'page' into the faulting
+                 region. Vary the contents that are copied in, so that it
+                 is more obvious that each fault is handled separately. */
+
+              memset(page, 'A' + fault_cnt % 20, PAGE_SIZE);
+              fault_cnt++;
+              batch_faults++;
+
+              struct uffdio_copy uffdio_copy;
+              uffdio_copy.src = (unsigned long) page;
+
+              /* We need to handle page faults in units of pages(!).
+                 So, round faulting address down to page boundary. */
+
+              uffdio_copy.dst = (unsigned long) msg->arg.pagefault.address & ~(PAGE_SIZE - 1);
+              uffdio_copy.len = PAGE_SIZE;
+              uffdio_copy.mode = 0;
+              uffdio_copy.copy = 0;
+              if (ioctl(uffd, UFFDIO_COPY, &uffdio_copy) == -1) {
+                  printf("ioctl-UFFDIO_COPY\n");
+                  exit(EXIT_FAILURE);
+              }
+
+              trace(TRACE_COPY, uffd, uffdio_copy.dst, 0, uffdio_copy.copy);
+          }
+
+          /* A short read means the queue is empty. With one message per read,
+             go back to poll() after every fault like the unbatched loop. */
+          if (MSGS_PER_READ == 1 || nmsgs < MSGS_PER_READ)
+            break;
       }
 
-      /* Display info about the page-fault event. */
-
-      printf("    UFFD_EVENT_PAGEFAULT event: ");
-      printf("flags = %"PRIx64"; ", msg.arg.pagefault.flags);
-      printf("address = %"PRIx64"\n", msg.arg.pagefault.address);
-
-      /* Copy the page pointed to by 'page' into the faulting
-         region. Vary the contents that are copied in, so that it
-         is more obvious that each fault is handled separately. */
-
-      memset(page, 'A' + fault_cnt % 20, PAGE_SIZE);
-      fault_cnt++;
-
-      struct uffdio_copy uffdio_copy;
-      uffdio_copy.src = (unsigned long) page;
-
-      /* We need to handle page faults in units of pages(!).
-         So, round faulting address down to page boundary. */
-
-      uffdio_copy.dst = (unsigned long) msg.arg.pagefault.address & ~(PAGE_SIZE - 1);
-      uffdio_copy.len = PAGE_SIZE;
-      uffdio_copy.mode = 0;
-      uffdio_copy.copy = 0;
-      if (ioctl(uffd, UFFDIO_COPY, &uffdio_copy) == -1) {
-          printf("ioctl-UFFDIO_COPY\n");
-          exit(EXIT_FAILURE);
-      }
-
-      printf("        (uffdio_copy.copy returned %"PRId64")\n",
-             uffdio_copy.copy);
+      /* Unbatched handling costs one poll() and one read() per fault. */
+      trace(TRACE_BATCH, uffd, syscalls, batch_faults, fault_cnt);
   }
 }
 
@@ -151,6 +177,8 @@ int main() {
   }
   printf("uffd_register\n");
 
+  trace_start();
+
   // create uffd thread
   pthread_t thr;
   int s = pthread_create(&thr, NULL, fault_handler_thread, (void*)uffd);
@@ -173,6 +201,7 @@ int main() {
   int n = read(memfd, &buff, 10);
   printf("10 bytes of memfd: %.*s\n", 10, &buff);
 
+  trace_stop();
   munmap(memfd_map, SIZE);
   close(memfd);
 }
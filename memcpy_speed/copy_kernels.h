@@ -0,0 +1,151 @@
+#ifndef COPY_KERNELS_H
+#define COPY_KERNELS_H
+
+// Copy kernels for mem_speed. Besides libc memcpy: rep movsb, and
+// streaming (non-temporal) stores that write around the caches, so a
+// multi-GB copy does not evict the working set of everything else on
+// the host. The vector kernels are compiled with target attributes or
+// inline asm, whether the cpu can run them is checked at runtime by
+// copy_kernels_detect().
+
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+typedef void (*copy_fn)(char* dst, const char* src, uint64_t n);
+
+struct copy_kernel {
+  const char* name;
+  copy_fn fn;
+  int supported;
+};
+
+static void copy_libc(char* dst, const char* src, uint64_t n) {
+  memcpy(dst, src, n);
+}
+
+#if defined(__x86_64__)
+// Fast with ERMS, and with FSRM also for short copies.
+static void copy_rep_movsb(char* dst, const char* src, uint64_t n) {
+  asm volatile("rep movsb" : "+D"(dst), "+S"(src), "+c"(n) : : "memory");
+}
+
+// The head up to the first aligned destination and the tail go through
+// memcpy, streaming stores need an aligned destination.
+__attribute__((target("avx2")))
+static void copy_avx2_nt(char* dst, const char* src, uint64_t n) {
+  uint64_t head = (32 - ((uintptr_t)dst & 31)) & 31;
+  if (head > n)
+    head = n;
+  memcpy(dst, src, head);
+  dst += head;
+  src += head;
+  n -= head;
+  for (; n >= 128; n -= 128, dst += 128, src += 128) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)src);
+    __m256i b = _mm256_loadu_si256((const __m256i*)(src + 32));
+    __m256i c = _mm256_loadu_si256((const __m256i*)(src + 64));
+    __m256i d = _mm256_loadu_si256((const __m256i*)(src + 96));
+    _mm256_stream_si256((__m256i*)dst, a);
+    _mm256_stream_si256((__m256i*)(dst + 32), b);
+    _mm256_stream_si256((__m256i*)(dst + 64), c);
+    _mm256_stream_si256((__m256i*)(dst + 96), d);
+  }
+  _mm_sfence();
+  memcpy(dst, src, n);
+}
+
+__attribute__((target("avx512f")))
+static void copy_avx512_nt(char* dst, const char* src, uint64_t n) {
+  uint64_t head = (64 - ((uintptr_t)dst & 63)) & 63;
+  if (head > n)
+    head = n;
+  memcpy(dst, src, head);
+  dst += head;
+  src += head;
+  n -= head;
+  for (; n >= 256; n -= 256, dst += 256, src += 256) {
+    __m512i a = _mm512_loadu_si512((const void*)src);
+    __m512i b = _mm512_loadu_si512((const void*)(src + 64));
+    __m512i c = _mm512_loadu_si512((const void*)(src + 128));
+    __m512i d = _mm512_loadu_si512((const void*)(src + 192));
+    _mm512_stream_si512((void*)dst, a);
+    _mm512_stream_si512((void*)(dst + 64), b);
+    _mm512_stream_si512((void*)(dst + 128), c);
+    _mm512_stream_si512((void*)(dst + 192), d);
+  }
+  _mm_sfence();
+  memcpy(dst, src, n);
+}
+#elif defined(__aarch64__)
+// ldp/stnp of q registers: STNP is the non-temporal hint on arm.
+static void copy_neon_nt(char* dst, const char* src, uint64_t n) {
+  for (; n >= 64; n -= 64, dst += 64, src += 64) {
+    asm volatile("ldp q0, q1, [%1]\n"
+                 "ldp q2, q3, [%1, #32]\n"
+                 "stnp q0, q1, [%0]\n"
+                 "stnp q2, q3, [%0, #32]\n"
+                 : : "r"(dst), "r"(src) : "v0", "v1", "v2", "v3", "memory");
+  }
+  memcpy(dst, src, n);
+}
+
+// One vector length per iteration, the predicate covers the tail.
+static void copy_sve_nt(char* dst, const char* src, uint64_t n) {
+  asm volatile(".arch_extension sve\n"
+               "mov x9, #0\n"
+               "1:\n"
+               "whilelo p0.b, x9, %2\n"
+               "b.none 2f\n"
+               "ld1b z0.b, p0/z, [%1, x9]\n"
+               "stnt1b z0.b, p0, [%0, x9]\n"
+               "incb x9\n"
+               "b 1b\n"
+               "2:\n"
+               : : "r"(dst), "r"(src), "r"(n) : "x9", "v0", "memory", "cc");
+}
+#endif
+
+static struct copy_kernel copy_kernels[] = {
+  { .name = "libc", .fn = copy_libc },
+#if defined(__x86_64__)
+  { .name = "rep_movsb", .fn = copy_rep_movsb },
+  { .name = "avx2_nt", .fn = copy_avx2_nt },
+  { .name = "avx512_nt", .fn = copy_avx512_nt },
+#elif defined(__aarch64__)
+  { .name = "neon_nt", .fn = copy_neon_nt },
+  { .name = "sve_nt", .fn = copy_sve_nt },
+#endif
+};
+
+#define NUM_COPY_KERNELS (sizeof(copy_kernels) / sizeof(copy_kernels[0]))
+
+// Mark the kernels this cpu can run and print what was found.
+static void copy_kernels_detect() {
+  for (int i = 0; i < NUM_COPY_KERNELS; i++)
+    copy_kernels[i].supported = 1;
+#if defined(__x86_64__)
+  unsigned int eax, ebx, ecx, edx;
+  int erms = 0, fsrm = 0;
+  if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+    erms = (ebx >> 9) & 1;
+    fsrm = (edx >> 4) & 1;
+  }
+  __builtin_cpu_init();
+  copy_kernels[2].supported = __builtin_cpu_supports("avx2") != 0;
+  copy_kernels[3].supported = __builtin_cpu_supports("avx512f") != 0;
+  printf("cpu: erms %d, fsrm %d, avx2 %d, avx512f %d\n", erms, fsrm,
+         copy_kernels[2].supported, copy_kernels[3].supported);
+#elif defined(__aarch64__)
+  copy_kernels[2].supported = (getauxval(AT_HWCAP) & HWCAP_SVE) != 0;
+  printf("cpu: sve %d\n", copy_kernels[2].supported);
+#endif
+}
+
+#endif
@@ -1,30 +1,147 @@
+#define _GNU_SOURCE
 #include <time.h>
+#include <sched.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/un.h>
 #include <sys/mman.h>
-#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <sys/syscall.h>
 #include <linux/memfd.h>
+#include <linux/perf_event.h>
 
-#define LOG_TIME(fn) \
-    struct timeval tv; \
-    gettimeofday(&tv,NULL); \
-    unsigned long before = 1000000 * tv.tv_sec + tv.tv_usec; \
-    fn; \
-    gettimeofday(&tv,NULL); \
-    unsigned long after = 1000000 * tv.tv_sec + tv.tv_usec; \
-    printf("diff: %ld us (%ld ms)\n", after - before, (after - before) / 1000); 
+#include "../common/loader.h"
+#include "../common/timing.h"
+#include "copy_kernels.h"
+#include "uring.h"
+
+// Thread counts of the parallel copy: 1, 2, 4, ... up to max_threads.
+#define MAX_THREAD_COUNTS 16
+
+static int max_threads = 0;
+static unsigned long chunk_size = 2 * 1024 * 1024;
+static int thread_counts[MAX_THREAD_COUNTS];
+static int num_thread_counts = 0;
+static char parallel_names[MAX_THREAD_COUNTS][32];
+static char pread_names[MAX_THREAD_COUNTS][32];
+// Kernels picked with -k, all supported ones by default.
+static int kernel_enabled[NUM_COPY_KERNELS];
+static char kernel_names[NUM_COPY_KERNELS][32];
+
+// Stands in for the working set of a workload sharing the host: warmed
+// before a kernel copy and read again after it. The slower the second
+// read, the more of it the copy evicted from the caches.
+#define PROBE_SIZE (4 * 1024 * 1024)
+static char* probe;
+
+// io_uring loader: reads of uring_block bytes, uring_depth in flight.
+static unsigned uring_depth = 32;
+static unsigned long uring_block = 1024 * 1024;
+
+struct uring_variant {
+  const char* name;
+  int fixed;
+  int direct;
+};
+
+static struct uring_variant uring_variants[] = {
+  { "io_uring", 0, 0 },
+  { "io_uring fixed", 1, 0 },
+  { "io_uring O_DIRECT", 0, 1 },
+  { "io_uring fixed O_DIRECT", 1, 1 },
+};
+
+#define NUM_URING_VARIANTS 4
+
+// Prefault and page size policies for the memcpy. `memfd_advice` and
+// `file_advice` go to madvise() on the memfd and the file mapping, 0
+// for none.
+struct prefault_policy {
+  const char* name;
+  int memfd_shared;
+  int populate;
+  int memfd_advice;
+  int file_advice;
+  int file_advice2;
+};
+
+static struct prefault_policy prefault_policies[] = {
+  { "private" },
+  { "shared", .memfd_shared = 1 },
+  { "MAP_POPULATE", .populate = 1 },
+  { "shared MAP_POPULATE", .memfd_shared = 1, .populate = 1 },
+  { "MADV_POPULATE_RW", .memfd_advice = MADV_POPULATE_WRITE, .file_advice = MADV_POPULATE_READ },
+  { "MADV_HUGEPAGE", .memfd_advice = MADV_HUGEPAGE },
+  { "shared MADV_HUGEPAGE", .memfd_shared = 1, .memfd_advice = MADV_HUGEPAGE },
+  { "WILLNEED SEQUENTIAL", .file_advice = MADV_WILLNEED, .file_advice2 = MADV_SEQUENTIAL },
+};
+
+#define NUM_PREFAULT_POLICIES (sizeof(prefault_policies) / sizeof(prefault_policies[0]))
 
 struct FileAndSize {
   char* name;
   unsigned long size;
+  // One sample per run of every test.
+  struct histogram memcpy_hist;
+  struct histogram fread_hist;
+  struct histogram kernel_load_hist[3];
+  struct histogram uring_hist[NUM_URING_VARIANTS];
+  // User plus system time, summed over the runs.
+  uint64_t memcpy_cpu_ns;
+  uint64_t fread_cpu_ns;
+  uint64_t uring_cpu_ns[NUM_URING_VARIANTS];
+  // Mapping setup (including any prefaulting) and the copy after it.
+  struct histogram fault_hist[NUM_PREFAULT_POLICIES];
+  struct histogram copy_hist[NUM_PREFAULT_POLICIES];
+  uint64_t copy_faults[NUM_PREFAULT_POLICIES];
+  struct histogram parallel_hist[MAX_THREAD_COUNTS];
+  // common/loader.h: fallocate of the memfd, then the parallel pread.
+  struct histogram fallocate_hist;
+  struct histogram pread_hist[MAX_THREAD_COUNTS];
+  struct histogram kernel_hist[NUM_COPY_KERNELS];
+  // Summed over the runs of every kernel.
+  uint64_t kernel_misses[NUM_COPY_KERNELS];
+  uint64_t kernel_probe_ns[NUM_COPY_KERNELS];
+};
+
+// Shared by the threads of one parallel copy. Threads claim chunk_size
+// pieces of the range from `next` until it is exhausted, so a thread
+// that is descheduled for a while does not hold up the others.
+struct parallel_copy {
+  char* dst;
+  char* src;
+  unsigned long size;
+  unsigned long next;
+  // Start gate: every thread counts itself `ready` once pinned and
+  // waits for `go`, 1 to copy or -1 when the copy is called off.
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int ready;
+  int go;
 };
 
+struct copy_thread {
+  struct parallel_copy* copy;
+  int cpu;
+  pthread_t thread;
+};
+
+// CPU time of the whole process, including the io_uring workers.
+uint64_t cpu_ns() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ul +
+         (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ul;
+}
+
 int test_memcpy(struct FileAndSize* file) {
   int memfd = syscall(SYS_memfd_create, file->name, 0);
   if (memfd < 0) {
@@ -57,12 +174,323 @@ int test_memcpy(struct FileAndSize* file) {
   }
 
   printf("memcpy: %ld MB\n", file->size / 1024 / 1024);
-  LOG_TIME(memcpy(memfd_map, file_map, file->size));
+  uint64_t cpu_before = cpu_ns();
+  TIME_INTO(file->memcpy_hist, memcpy(memfd_map, file_map, file->size));
+  file->memcpy_cpu_ns += cpu_ns() - cpu_before;
+
+  munmap(memfd_map, file->size);
+  munmap(file_map, file->size);
+  close(memfd);
+  close(file_fd);
+  return 0;
+}
+
+void* copy_chunks(void* arg) {
+  struct copy_thread* t = (struct copy_thread*)arg;
+  struct parallel_copy* c = t->copy;
+
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(t->cpu, &cpus);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+    printf("pinning to cpu %d failed\n", t->cpu);
+
+  pthread_mutex_lock(&c->lock);
+  c->ready++;
+  pthread_cond_broadcast(&c->cond);
+  while (!c->go)
+    pthread_cond_wait(&c->cond, &c->lock);
+  int go = c->go;
+  pthread_mutex_unlock(&c->lock);
+  if (go < 0)
+    return NULL;
+
+  for (;;) {
+    unsigned long off = __atomic_fetch_add(&c->next, chunk_size, __ATOMIC_RELAXED);
+    if (off >= c->size)
+      break;
+    unsigned long len = c->size - off < chunk_size ? c->size - off : chunk_size;
+    memcpy(c->dst + off, c->src + off, len);
+  }
+  return NULL;
+}
+
+// Wait until `threads` threads of `c` are pinned and at the gate.
+void wait_ready(struct parallel_copy* c, int threads) {
+  pthread_mutex_lock(&c->lock);
+  while (c->ready < threads)
+    pthread_cond_wait(&c->cond, &c->lock);
+  pthread_mutex_unlock(&c->lock);
+}
+
+// Open the start gate of `c` with `go`.
+void start_copy(struct parallel_copy* c, int go) {
+  pthread_mutex_lock(&c->lock);
+  c->go = go;
+  pthread_cond_broadcast(&c->cond);
+  pthread_mutex_unlock(&c->lock);
+}
+
+// Same copy as test_memcpy, split over `threads` threads pinned to
+// consecutive cpus. Threads are created and pinned before the clock
+// starts.
+int test_memcpy_parallel(struct FileAndSize* file, int threads, struct histogram* hist) {
+  int memfd = syscall(SYS_memfd_create, file->name, 0);
+  if (memfd < 0) {
+    printf("memfd failed\n");
+    return 1;
+  }
+
+  int r = ftruncate(memfd, file->size);
+  if (r < 0) {
+    printf("memfd failed\n");
+    return 1;
+  }
+
+  char* memfd_map = (char*)mmap(0, file->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, memfd, 0);
+  if (memfd_map == MAP_FAILED) {
+    printf("memfd map failed\n");
+    return 1;
+  }
+
+  int file_fd = open(file->name, O_RDWR, 0);
+  if (file_fd < 0) {
+    printf("open file failed");
+    return 1;
+  }
+
+  char* file_map = (char*)mmap(0, file->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file_fd, 0);
+  if (file_map == MAP_FAILED) {
+    printf("file map failed\n");
+    return 1;
+  }
 
+  struct parallel_copy copy = {
+    .dst = memfd_map,
+    .src = file_map,
+    .size = file->size,
+    .next = 0,
+    .ready = 0,
+    .go = 0,
+  };
+  pthread_mutex_init(&copy.lock, NULL);
+  pthread_cond_init(&copy.cond, NULL);
+  struct copy_thread* ts = calloc(threads, sizeof(struct copy_thread));
+  int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int started = 0;
+  for (; started < threads; started++) {
+    ts[started].copy = &copy;
+    ts[started].cpu = started % ncpus;
+    if (pthread_create(&ts[started].thread, NULL, copy_chunks, &ts[started]) != 0)
+      break;
+  }
+
+  int ret = 0;
+  if (started < threads) {
+    // Call the copy off and let the threads that did start go.
+    printf("thread creation failed\n");
+    start_copy(&copy, -1);
+    for (int i = 0; i < started; i++)
+      pthread_join(ts[i].thread, NULL);
+    ret = 1;
+  } else {
+    printf("memcpy: %ld MB, %d threads\n", file->size / 1024 / 1024, threads);
+    wait_ready(&copy, threads);
+    TIME_INTO(*hist, start_copy(&copy, 1);
+                     for (int i = 0; i < threads; i++) pthread_join(ts[i].thread, NULL));
+  }
+
+  pthread_mutex_destroy(&copy.lock);
+  pthread_cond_destroy(&copy.cond);
+  free(ts);
   munmap(memfd_map, file->size);
   munmap(file_map, file->size);
   close(memfd);
   close(file_fd);
+  return ret;
+}
+
+// Hardware cache misses (last level on most cpus) of this thread, -1
+// when the cpu or the sandbox exposes no counter.
+int open_miss_counter() {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.disabled = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+uint64_t read_probe() {
+  volatile char sum = 0;
+  uint64_t before = timing_now();
+  for (int off = 0; off < PROBE_SIZE; off += 64)
+    sum += probe[off];
+  return timing_now() - before;
+}
+
+// Copy the file with kernel `k`. Unlike test_memcpy both mappings are
+// populated up front, so the time is the copy and not the page faults.
+int test_copy_kernel(struct FileAndSize* file, int k) {
+  int ret = 1;
+  char* memfd_map = MAP_FAILED;
+  char* file_map = MAP_FAILED;
+  int file_fd = -1;
+  int memfd = syscall(SYS_memfd_create, file->name, 0);
+  if (memfd < 0) {
+    printf("memfd failed\n");
+    return 1;
+  }
+
+  int r = ftruncate(memfd, file->size);
+  if (r < 0) {
+    printf("memfd failed\n");
+    goto out;
+  }
+
+  memfd_map = (char*)mmap(0, file->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_POPULATE,
+                          memfd, 0);
+  if (memfd_map == MAP_FAILED) {
+    printf("memfd map failed\n");
+    goto out;
+  }
+
+  file_fd = open(file->name, O_RDWR, 0);
+  if (file_fd < 0) {
+    printf("open file failed");
+    goto out;
+  }
+
+  file_map = (char*)mmap(0, file->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_POPULATE,
+                         file_fd, 0);
+  if (file_map == MAP_FAILED) {
+    printf("file map failed\n");
+    goto out;
+  }
+
+  printf("%s: %ld MB\n", copy_kernels[k].name, file->size / 1024 / 1024);
+  int counter = open_miss_counter();
+  read_probe();
+  if (counter >= 0) {
+    ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+    ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  TIME_INTO(file->kernel_hist[k], copy_kernels[k].fn(memfd_map, file_map, file->size));
+  if (counter >= 0) {
+    ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+    uint64_t misses = 0;
+    if (read(counter, &misses, sizeof(misses)) == sizeof(misses))
+      file->kernel_misses[k] += misses;
+    close(counter);
+  }
+  file->kernel_probe_ns[k] += read_probe();
+  ret = 0;
+
+out:
+  if (memfd_map != MAP_FAILED)
+    munmap(memfd_map, file->size);
+  if (file_map != MAP_FAILED)
+    munmap(file_map, file->size);
+  close(memfd);
+  if (file_fd >= 0)
+    close(file_fd);
+  return ret;
+}
+
+uint64_t page_faults() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_minflt + ru.ru_majflt;
+}
+
+// test_memcpy with prefault policy `p`. The mmap and madvise calls are
+// timed apart from the copy, so prefaulting policies show what the
+// faults cost, and the faults taken during the copy are counted for the
+// lazy ones.
+int test_prefault(struct FileAndSize* file, int p) {
+  struct prefault_policy* policy = &prefault_policies[p];
+  int memfd = syscall(SYS_memfd_create, file->name, 0);
+  if (memfd < 0) {
+    printf("memfd failed\n");
+    return 1;
+  }
+
+  int r = ftruncate(memfd, file->size);
+  if (r < 0) {
+    printf("memfd failed\n");
+    return 1;
+  }
+
+  int file_fd = open(file->name, O_RDWR, 0);
+  if (file_fd < 0) {
+    printf("open file failed");
+    return 1;
+  }
+
+  printf("%s: %ld MB\n", policy->name, file->size / 1024 / 1024);
+  int populate = policy->populate ? MAP_POPULATE : 0;
+  uint64_t before = timing_now();
+  char* memfd_map = (char*)mmap(0, file->size, PROT_READ | PROT_WRITE,
+                                (policy->memfd_shared ? MAP_SHARED : MAP_PRIVATE) | populate,
+                                memfd, 0);
+  if (memfd_map == MAP_FAILED) {
+    printf("memfd map failed\n");
+    return 1;
+  }
+  char* file_map = (char*)mmap(0, file->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | populate,
+                               file_fd, 0);
+  if (file_map == MAP_FAILED) {
+    printf("file map failed\n");
+    return 1;
+  }
+  if (policy->memfd_advice && madvise(memfd_map, file->size, policy->memfd_advice) < 0)
+    perror("memfd madvise");
+  if (policy->file_advice && madvise(file_map, file->size, policy->file_advice) < 0)
+    perror("file madvise");
+  if (policy->file_advice2 && madvise(file_map, file->size, policy->file_advice2) < 0)
+    perror("file madvise");
+  hist_record(&file->fault_hist[p], timing_now() - before);
+
+  uint64_t faults_before = page_faults();
+  TIME_INTO(file->copy_hist[p], memcpy(memfd_map, file_map, file->size));
+  file->copy_faults[p] += page_faults() - faults_before;
+
+  munmap(memfd_map, file->size);
+  munmap(file_map, file->size);
+  close(memfd);
+  close(file_fd);
+  return 0;
+}
+
+// The snapshot loader of the uffd servers, with `threads` threads
+// reading chunk_size bytes per pread.
+int test_parallel_pread(struct FileAndSize* file, int t) {
+  int memfd;
+  uint64_t before = timing_now();
+  char* memfd_map = loader_memfd(file->name, file->size, &memfd);
+  if (!memfd_map) {
+    perror("loader memfd failed");
+    return 1;
+  }
+  hist_record(&file->fallocate_hist, timing_now() - before);
+
+  int file_fd = open(file->name, O_RDONLY, 0);
+  if (file_fd < 0) {
+    printf("open file failed");
+    return 1;
+  }
+
+  printf("pread: %ld MB, %d threads\n", file->size / 1024 / 1024, thread_counts[t]);
+  TIME_INTO(file->pread_hist[t],
+            int r = parallel_pread(file_fd, 0, memfd_map, file->size, thread_counts[t], chunk_size));
+  if (r < 0)
+    perror("parallel pread failed");
+
+  munmap(memfd_map, file->size);
+  close(memfd);
+  close(file_fd);
+  return r < 0 ? 1 : 0;
 }
 
 int test_fread(struct FileAndSize* file) {
@@ -87,14 +515,427 @@ int test_fread(struct FileAndSize* file) {
   FILE *file_fd = fopen(file->name, "rb");
 
   printf("fread\n");
-  LOG_TIME(fread(memfd_map, file->size, 1, file_fd));
+  uint64_t cpu_before = cpu_ns();
+  TIME_INTO(file->fread_hist, fread(memfd_map, file->size, 1, file_fd));
+  file->fread_cpu_ns += cpu_ns() - cpu_before;
 
   munmap(memfd_map, file->size);
   close(memfd);
   fclose(file_fd);
+  return 0;
+}
+
+// Loaders that fill the memfd straight from the file inside the kernel:
+// no user space buffer, no mapping and no page faults on either side.
+// They return the bytes moved by the last call, -1 on errors. A file
+// shorter than `size` is an error too, with errno ENODATA.
+ssize_t load_copy_file_range(int memfd, int file_fd, unsigned long size) {
+  loff_t in = 0, out = 0;
+  ssize_t n = 0;
+  while (in < size) {
+    n = copy_file_range(file_fd, &in, memfd, &out, size - in, 0);
+    if (n == 0)
+      errno = ENODATA;
+    if (n <= 0)
+      return -1;
+  }
+  return n;
 }
 
-int main() {
+ssize_t load_sendfile(int memfd, int file_fd, unsigned long size) {
+  off_t in = 0;
+  ssize_t n = 0;
+  while (in < size) {
+    n = sendfile(memfd, file_fd, &in, size - in);
+    if (n == 0)
+      errno = ENODATA;
+    if (n <= 0)
+      return -1;
+  }
+  return n;
+}
+
+// File to pipe to memfd. A bigger pipe means fewer splice calls.
+ssize_t load_splice(int memfd, int file_fd, unsigned long size) {
+  int pipefd[2];
+  if (pipe(pipefd) < 0)
+    return -1;
+  fcntl(pipefd[1], F_SETPIPE_SZ, 1024 * 1024);
+  loff_t in = 0, out = 0;
+  ssize_t n = 0;
+  while (in < size) {
+    n = splice(file_fd, &in, pipefd[1], NULL, size - in, SPLICE_F_MOVE);
+    if (n == 0)
+      errno = ENODATA;
+    if (n <= 0) {
+      n = -1;
+      break;
+    }
+    for (ssize_t left = n; left > 0; ) {
+      ssize_t m = splice(pipefd[0], NULL, memfd, &out, left, SPLICE_F_MOVE);
+      if (m <= 0) {
+        n = -1;
+        goto done;
+      }
+      left -= m;
+    }
+  }
+done:
+  close(pipefd[0]);
+  close(pipefd[1]);
+  return n;
+}
+
+struct loader {
+  const char* name;
+  ssize_t (*load)(int memfd, int file_fd, unsigned long size);
+};
+
+static struct loader loaders[] = {
+  { "copy_file_range", load_copy_file_range },
+  { "sendfile", load_sendfile },
+  { "splice", load_splice },
+};
+
+int test_kernel_load(struct FileAndSize* file, int l) {
+  int memfd = syscall(SYS_memfd_create, file->name, 0);
+  if (memfd < 0) {
+    printf("memfd failed\n");
+    return 1;
+  }
+
+  int r = ftruncate(memfd, file->size);
+  if (r < 0) {
+    printf("memfd failed\n");
+    return 1;
+  }
+
+  int file_fd = open(file->name, O_RDONLY, 0);
+  if (file_fd < 0) {
+    printf("open file failed");
+    return 1;
+  }
+
+  printf("%s\n", loaders[l].name);
+  struct histogram attempt;
+  hist_init(&attempt, loaders[l].name);
+  TIME_INTO(attempt, ssize_t n = loaders[l].load(memfd, file_fd, file->size));
+  // copy_file_range between filesystems fails with EXDEV on newer
+  // kernels, such a run is not counted.
+  if (n < 0)
+    perror(loaders[l].name);
+  else
+    hist_merge(&file->kernel_load_hist[l], &attempt);
+
+  close(memfd);
+  close(file_fd);
+  return n < 0 ? 1 : 0;
+}
+
+// Read the file into the memfd mapping through io_uring, keeping up to
+// uring_depth reads in flight. Registered buffers map the whole memfd
+// once (in up to 1 GiB buffers, the kernel limit), so every read skips
+// pinning its pages; the registration is timed as part of the load.
+int load_uring(struct uring_variant* v, int file_fd, char* map, unsigned long size) {
+  struct uring u;
+  if (uring_init(&u, uring_depth) < 0) {
+    perror("io_uring_setup");
+    return -1;
+  }
+
+  const unsigned long buf_size = 1024 * 1024 * 1024;
+  if (v->fixed) {
+    struct iovec iovs[64];
+    unsigned n = 0;
+    for (unsigned long off = 0; off < size && n < 64; off += buf_size, n++) {
+      iovs[n].iov_base = map + off;
+      iovs[n].iov_len = size - off < buf_size ? size - off : buf_size;
+    }
+    if (uring_register_buffers(&u, iovs, n) < 0) {
+      perror("IORING_REGISTER_BUFFERS");
+      uring_exit(&u);
+      return -1;
+    }
+  }
+
+  // One slot per read in flight, user_data is the slot index.
+  struct read_slot {
+    uint64_t off;
+    uint64_t len;
+  };
+  struct read_slot* slots = calloc(uring_depth, sizeof(struct read_slot));
+  unsigned* free_slots = calloc(uring_depth, sizeof(unsigned));
+  for (unsigned i = 0; i < uring_depth; i++)
+    free_slots[i] = i;
+  unsigned nfree = uring_depth, queued = 0;
+  unsigned long next = 0, done = 0;
+  int err = 0;
+  while (done < size && !err) {
+    while (nfree && next < size) {
+      // A read never crosses a registered buffer.
+      unsigned long len = size - next < uring_block ? size - next : uring_block;
+      if (next / buf_size != (next + len - 1) / buf_size)
+        len = (next / buf_size + 1) * buf_size - next;
+      unsigned slot = free_slots[--nfree];
+      slots[slot].off = next;
+      slots[slot].len = len;
+      uring_prep_read(&u, file_fd, map + next, len, next, v->fixed ? next / buf_size : -1, slot);
+      queued++;
+      next += len;
+    }
+    if (uring_enter(&u, queued, 1) < 0) {
+      perror("io_uring_enter");
+      err = -1;
+      break;
+    }
+    queued = 0;
+
+    struct io_uring_cqe* cqe;
+    while ((cqe = uring_peek_cqe(&u))) {
+      unsigned slot = cqe->user_data;
+      int res = cqe->res;
+      uring_cqe_seen(&u);
+      if (res <= 0) {
+        errno = res ? -res : EIO;
+        perror("io_uring read");
+        err = -1;
+        break;
+      }
+      done += res;
+      struct read_slot* s = &slots[slot];
+      if (res < s->len) {
+        // Short read: the slot reads the rest.
+        s->off += res;
+        s->len -= res;
+        uring_prep_read(&u, file_fd, map + s->off, s->len, s->off,
+                        v->fixed ? s->off / buf_size : -1, slot);
+        queued++;
+      } else {
+        free_slots[nfree++] = slot;
+      }
+    }
+  }
+  free(slots);
+  free(free_slots);
+  uring_exit(&u);
+  return err;
+}
+
+int test_uring(struct FileAndSize* file, int i) {
+  struct uring_variant* v = &uring_variants[i];
+  int memfd = syscall(SYS_memfd_create, file->name, 0);
+  if (memfd < 0) {
+    printf("memfd failed\n");
+    return 1;
+  }
+
+  int r = ftruncate(memfd, file->size);
+  if (r < 0) {
+    printf("memfd failed\n");
+    return 1;
+  }
+
+  char* memfd_map = (char*)mmap(0, file->size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (memfd_map == MAP_FAILED) {
+    printf("memfd map failed\n");
+    return 1;
+  }
+
+  int file_fd = open(file->name, O_RDONLY | (v->direct ? O_DIRECT : 0), 0);
+  if (file_fd < 0) {
+    printf("open file failed");
+    return 1;
+  }
+
+  printf("%s: depth %u, %lu KiB reads\n", v->name, uring_depth, uring_block / 1024);
+  struct histogram attempt;
+  hist_init(&attempt, v->name);
+  uint64_t cpu_before = cpu_ns();
+  TIME_INTO(attempt, int err = load_uring(v, file_fd, memfd_map, file->size));
+  if (!err) {
+    hist_merge(&file->uring_hist[i], &attempt);
+    file->uring_cpu_ns[i] += cpu_ns() - cpu_before;
+  }
+
+  munmap(memfd_map, file->size);
+  close(memfd);
+  close(file_fd);
+  return err ? 1 : 0;
+}
+
+// Report every test, with its bandwidth at the median.
+void print_results(struct FileAndSize* file, int runs) {
+  struct histogram* hists[] = { &file->memcpy_hist, &file->fread_hist, &file->kernel_load_hist[0],
+                                &file->kernel_load_hist[1], &file->kernel_load_hist[2] };
+  for (int i = 0; i < 5; i++) {
+    hist_print(hists[i]);
+    uint64_t p50 = hist_percentile(hists[i], 50);
+    if (p50)
+      printf("%-24s %.2f GB/s at p50\n", "", file->size / (double)p50);
+  }
+
+  // io_uring next to memcpy and fread, with the CPU time they burn.
+  double gb = file->size / 1e9;
+  struct histogram* cpu_hists[2 + NUM_URING_VARIANTS] = { &file->memcpy_hist, &file->fread_hist };
+  uint64_t cpu[2 + NUM_URING_VARIANTS] = { file->memcpy_cpu_ns, file->fread_cpu_ns };
+  for (int i = 0; i < NUM_URING_VARIANTS; i++) {
+    cpu_hists[2 + i] = &file->uring_hist[i];
+    cpu[2 + i] = file->uring_cpu_ns[i];
+  }
+  printf("%-24s %10s %14s\n", "load", "GB/s p50", "CPU ms per GB");
+  for (int i = 0; i < 2 + NUM_URING_VARIANTS; i++) {
+    uint64_t p50 = hist_percentile(cpu_hists[i], 50);
+    if (!cpu_hists[i]->count) {
+      printf("%-24s %10s %14s\n", cpu_hists[i]->name, "failed", "");
+      continue;
+    }
+    printf("%-24s %10.2f %14.1f\n", cpu_hists[i]->name, file->size / (double)p50,
+           cpu[i] / 1e6 / cpu_hists[i]->count / gb);
+  }
+
+  // Where the memcpy time goes: setting up (and prefaulting) the
+  // mappings, and the copy with whatever faults are left.
+  printf("%-24s %12s %12s %12s %16s\n", "prefault", "faults p50", "copy p50", "total",
+         "faults in copy");
+  for (int p = 0; p < NUM_PREFAULT_POLICIES; p++) {
+    uint64_t fault = hist_percentile(&file->fault_hist[p], 50);
+    uint64_t copy = hist_percentile(&file->copy_hist[p], 50);
+    char fault_s[32], copy_s[32], total_s[32];
+    hist_format(fault_s, sizeof(fault_s), fault);
+    hist_format(copy_s, sizeof(copy_s), copy);
+    hist_format(total_s, sizeof(total_s), fault + copy);
+    printf("%-24s %12s %12s %12s %16"PRIu64"\n", prefault_policies[p].name, fault_s, copy_s,
+           total_s, file->copy_faults[p] / runs);
+  }
+
+  // Scaling of the parallel copy. The bus is saturated once doubling
+  // the threads adds less than 10%.
+  double single = 0, last = 0;
+  int saturated = 0;
+  for (int i = 0; i < num_thread_counts; i++) {
+    hist_print(&file->parallel_hist[i]);
+    uint64_t p50 = hist_percentile(&file->parallel_hist[i], 50);
+    if (!p50)
+      continue;
+    double gbs = file->size / (double)p50;
+    if (i == 0)
+      single = gbs;
+    printf("%-24s %.2f GB/s at p50, %.2fx of 1 thread\n", "", gbs, gbs / single);
+    if (i > 0 && !saturated && gbs < last * 1.1)
+      saturated = thread_counts[i - 1];
+    last = gbs;
+  }
+  if (saturated)
+    printf("%-24s saturated at %d threads\n", "", saturated);
+
+  hist_print(&file->fallocate_hist);
+  for (int i = 0; i < num_thread_counts; i++) {
+    hist_print(&file->pread_hist[i]);
+    uint64_t p50 = hist_percentile(&file->pread_hist[i], 50);
+    if (p50)
+      printf("%-24s %.2f GB/s at p50\n", "", file->size / (double)p50);
+  }
+
+  // Kernels side by side. Misses are per MB copied; the probe column is
+  // the time to read the warmed probe buffer again after the copy.
+  int counted = open_miss_counter();
+  if (counted >= 0)
+    close(counted);
+  printf("%-24s %10s %14s %12s\n", "kernel", "GB/s p50", "misses/MB", "probe reread");
+  for (int k = 0; k < NUM_COPY_KERNELS; k++) {
+    if (!kernel_enabled[k])
+      continue;
+    uint64_t p50 = hist_percentile(&file->kernel_hist[k], 50);
+    char misses[32];
+    if (counted >= 0)
+      snprintf(misses, sizeof(misses), "%.0f",
+               file->kernel_misses[k] / (double)runs / (file->size / 1024 / 1024));
+    else
+      snprintf(misses, sizeof(misses), "n/a");
+    char reread[32];
+    hist_format(reread, sizeof(reread), file->kernel_probe_ns[k] / runs);
+    printf("%-24s %10.2f %14s %12s\n", copy_kernels[k].name,
+           p50 ? file->size / (double)p50 : 0.0, misses, reread);
+  }
+}
+
+// Enable the comma separated kernels in `list`.
+int select_kernels(char* list) {
+  memset(kernel_enabled, 0, sizeof(kernel_enabled));
+  for (char* name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+    int k;
+    for (k = 0; k < NUM_COPY_KERNELS; k++)
+      if (!strcmp(name, copy_kernels[k].name))
+        break;
+    if (k == NUM_COPY_KERNELS) {
+      printf("unknown kernel %s\n", name);
+      return -1;
+    }
+    if (!copy_kernels[k].supported) {
+      printf("kernel %s is not supported by this cpu\n", name);
+      return -1;
+    }
+    kernel_enabled[k] = 1;
+  }
+  return 0;
+}
+
+void usage(const char* name) {
+  printf("Usage: %s [-t max threads] [-c chunk KiB] [-k kernels] [-q depth] [-b KiB] [runs]\n",
+         name);
+  printf("  -t  parallel copy with 1, 2, 4, ... up to N threads (default: online cpus)\n");
+  printf("  -c  chunk claimed by a copy or pread thread at a time (default %lu KiB)\n",
+         chunk_size / 1024);
+  printf("  -k  comma separated copy kernels (default: all this cpu supports):");
+  for (int k = 0; k < NUM_COPY_KERNELS; k++)
+    printf(" %s", copy_kernels[k].name);
+  printf("\n");
+  printf("  -q  io_uring reads in flight (default %u)\n", uring_depth);
+  printf("  -b  io_uring read size (default %lu KiB)\n", uring_block / 1024);
+}
+
+int main(int argc, char** argv) {
+  copy_kernels_detect();
+  for (int k = 0; k < NUM_COPY_KERNELS; k++)
+    kernel_enabled[k] = copy_kernels[k].supported;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:c:k:q:b:h")) != -1) {
+    switch (opt) {
+      case 't': max_threads = atoi(optarg); break;
+      case 'c': chunk_size = strtoul(optarg, NULL, 0) * 1024; break;
+      case 'k':
+        if (select_kernels(optarg) < 0)
+          exit(EXIT_FAILURE);
+        break;
+      case 'q': uring_depth = atoi(optarg); break;
+      case 'b': uring_block = strtoul(optarg, NULL, 0) * 1024; break;
+      default: usage(argv[0]); exit(EXIT_FAILURE);
+    }
+  }
+  int runs = optind < argc ? atoi(argv[optind]) : 1;
+  if (max_threads <= 0)
+    max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  // O_DIRECT reads must stay block aligned.
+  if (chunk_size == 0 || uring_depth == 0 || uring_block == 0 || uring_block % 4096 ||
+      uring_block > (1ul << 30)) {
+    usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  for (int t = 1; num_thread_counts < MAX_THREAD_COUNTS; t *= 2) {
+    if (t > max_threads)
+      t = max_threads;
+    thread_counts[num_thread_counts++] = t;
+    if (t == max_threads)
+      break;
+  }
+  for (int i = 0; i < num_thread_counts; i++)
+    snprintf(parallel_names[i], sizeof(parallel_names[i]), "memcpy %d threads", thread_counts[i]);
+  for (int i = 0; i < num_thread_counts; i++)
+    snprintf(pread_names[i], sizeof(pread_names[i]), "pread %d threads", thread_counts[i]);
+  for (int k = 0; k < NUM_COPY_KERNELS; k++)
+    snprintf(kernel_names[k], sizeof(kernel_names[k]), "copy %s", copy_kernels[k].name);
+
   struct FileAndSize files[] = {
     {"test_mem_file_250m", 250 * 1024 * 1024},
     {"test_mem_file_500m", 500 * 1024 * 1024},
@@ -102,9 +943,55 @@ int main() {
     // {"test_mem_file_2g", 2ul * 1024ul * 1024ul * 1024ul},
   };
   for (int i = 0; i < 3; i++) {
-    printf("testing: %s\n", files[i].name);
-    test_memcpy(&files[i]);
-    test_fread(&files[i]);
+    hist_init(&files[i].memcpy_hist, "memcpy");
+    hist_init(&files[i].fread_hist, "fread");
+    for (int l = 0; l < 3; l++)
+      hist_init(&files[i].kernel_load_hist[l], loaders[l].name);
+    for (int u = 0; u < NUM_URING_VARIANTS; u++) {
+      hist_init(&files[i].uring_hist[u], uring_variants[u].name);
+      files[i].uring_cpu_ns[u] = 0;
+    }
+    files[i].memcpy_cpu_ns = files[i].fread_cpu_ns = 0;
+    for (int p = 0; p < NUM_PREFAULT_POLICIES; p++) {
+      hist_init(&files[i].fault_hist[p], "faults");
+      hist_init(&files[i].copy_hist[p], "copy");
+      files[i].copy_faults[p] = 0;
+    }
+    for (int j = 0; j < num_thread_counts; j++)
+      hist_init(&files[i].parallel_hist[j], parallel_names[j]);
+    hist_init(&files[i].fallocate_hist, "fallocate");
+    for (int j = 0; j < num_thread_counts; j++)
+      hist_init(&files[i].pread_hist[j], pread_names[j]);
+    for (int k = 0; k < NUM_COPY_KERNELS; k++) {
+      hist_init(&files[i].kernel_hist[k], kernel_names[k]);
+      files[i].kernel_misses[k] = files[i].kernel_probe_ns[k] = 0;
+    }
+  }
+  probe = malloc(PROBE_SIZE);
+  memset(probe, 1, PROBE_SIZE);
+  for (int run = 0; run < runs; run++) {
+    for (int i = 0; i < 3; i++) {
+      printf("testing: %s\n", files[i].name);
+      test_memcpy(&files[i]);
+      test_fread(&files[i]);
+      for (int l = 0; l < 3; l++)
+        test_kernel_load(&files[i], l);
+      for (int u = 0; u < NUM_URING_VARIANTS; u++)
+        test_uring(&files[i], u);
+      for (int p = 0; p < NUM_PREFAULT_POLICIES; p++)
+        test_prefault(&files[i], p);
+      for (int j = 0; j < num_thread_counts; j++)
+        test_memcpy_parallel(&files[i], thread_counts[j], &files[i].parallel_hist[j]);
+      for (int j = 0; j < num_thread_counts; j++)
+        test_parallel_pread(&files[i], j);
+      for (int k = 0; k < NUM_COPY_KERNELS; k++)
+        if (kernel_enabled[k])
+          test_copy_kernel(&files[i], k);
+    }
+  }
+  for (int i = 0; i < 3; i++) {
+    printf("%s:\n", files[i].name);
+    print_results(&files[i], runs);
   }
   return 0;
 }
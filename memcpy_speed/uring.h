@@ -0,0 +1,116 @@
+#ifndef URING_H
+#define URING_H
+
+// Just enough io_uring for mem_speed, on the raw syscalls so it builds
+// without liburing: one ring, reads in, completions out. The kernel
+// owns the SQ head and the CQ tail, we own the SQ tail and the CQ head;
+// every index the other side reads is published with a release store.
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct uring {
+  int fd;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  struct io_uring_sqe* sqes;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_cqe* cqes;
+  void* ring;
+  size_t ring_size;
+  size_t sqes_size;
+};
+
+static int uring_init(struct uring* u, unsigned depth) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  u->fd = syscall(SYS_io_uring_setup, depth, &p);
+  if (u->fd < 0)
+    return -1;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    close(u->fd);
+    return -1;
+  }
+
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  u->ring_size = sq_size > cq_size ? sq_size : cq_size;
+  u->ring = mmap(0, u->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                 IORING_OFF_SQ_RING);
+  u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = (struct io_uring_sqe*)mmap(0, u->sqes_size, PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (u->ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+    close(u->fd);
+    return -1;
+  }
+
+  char* ring = (char*)u->ring;
+  u->sq_head = (unsigned*)(ring + p.sq_off.head);
+  u->sq_tail = (unsigned*)(ring + p.sq_off.tail);
+  u->sq_mask = (unsigned*)(ring + p.sq_off.ring_mask);
+  u->sq_array = (unsigned*)(ring + p.sq_off.array);
+  u->cq_head = (unsigned*)(ring + p.cq_off.head);
+  u->cq_tail = (unsigned*)(ring + p.cq_off.tail);
+  u->cq_mask = (unsigned*)(ring + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe*)(ring + p.cq_off.cqes);
+  return 0;
+}
+
+static void uring_exit(struct uring* u) {
+  munmap(u->sqes, u->sqes_size);
+  munmap(u->ring, u->ring_size);
+  close(u->fd);
+}
+
+static int uring_register_buffers(struct uring* u, struct iovec* iovs, unsigned n) {
+  return syscall(SYS_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, iovs, n);
+}
+
+// Queue a read, visible to the kernel with the next uring_enter().
+// `buf_index` >= 0 makes it a READ_FIXED from that registered buffer.
+static void uring_prep_read(struct uring* u, int fd, void* buf, unsigned len, uint64_t off,
+                            int buf_index, uint64_t user_data) {
+  unsigned tail = *u->sq_tail;
+  unsigned i = tail & *u->sq_mask;
+  struct io_uring_sqe* sqe = &u->sqes[i];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = buf_index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)buf;
+  sqe->len = len;
+  sqe->off = off;
+  sqe->buf_index = buf_index >= 0 ? buf_index : 0;
+  sqe->user_data = user_data;
+  u->sq_array[i] = i;
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Submit `to_submit` queued reads and wait for at least `wait` completions.
+static int uring_enter(struct uring* u, unsigned to_submit, unsigned wait) {
+  return syscall(SYS_io_uring_enter, u->fd, to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0,
+                 NULL, 0);
+}
+
+// Next completion or NULL, release it with uring_cqe_seen().
+static struct io_uring_cqe* uring_peek_cqe(struct uring* u) {
+  unsigned head = *u->cq_head;
+  if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &u->cqes[head & *u->cq_mask];
+}
+
+static void uring_cqe_seen(struct uring* u) {
+  __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -1,18 +1,84 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/un.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/syscall.h>
 #include <linux/memfd.h>
 
-static int SIZE = 300;
+#include "../common/doorbell.h"
+#include "../common/memfd_pool.h"
+#include "../common/shm_ring.h"
+
+static int SIZE = 64 * 1024;
+static int RING_OFFSET = 4096;
+static int NUM_MESSAGES = 10;
 static char* SERVER_SOCKET_PATH = "test_socket";
 
-int main() {
+int get_fd(int sockfd) {
+  char iov_dummy;
+  struct iovec iov = { 
+    .iov_base = &iov_dummy, 
+    .iov_len = sizeof(char) 
+  };
+  char buff[CMSG_SPACE(sizeof(int))];
+
+  struct msghdr msg = {
+    .msg_name = 0,
+    .msg_namelen = 0,
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = &buff,
+    .msg_controllen = sizeof(buff),
+    .msg_flags = 0,
+  };
+
+  int n = recvmsg(sockfd, &msg, 0);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (n < 0 || !cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+    printf("no fd in the message\n");
+    exit(EXIT_FAILURE);
+  }
+  return *(int*)CMSG_DATA(cmsg); // receive file descriptor
+}
+
+// Every message is its own sealed memfd, trimmed to the message. Once
+// the seals are verified the contents cannot change under us, so the
+// message is used straight from the mapping.
+int sealed_handoff(int sockfd) {
+  for (int i = 0; i < NUM_MESSAGES; i++) {
+    int memfd = get_fd(sockfd);
+    if (memfd_check_seals(memfd) < 0) {
+      perror("memfd is not sealed");
+      return 1;
+    }
+    struct stat st;
+    if (fstat(memfd, &st) < 0) {
+      perror("memfd fstat failed");
+      return 1;
+    }
+    const char* message = (const char*)mmap(0, st.st_size, PROT_READ, MAP_SHARED, memfd, 0);
+    if (message == MAP_FAILED) {
+      printf("memfd map failed\n");
+      return 1;
+    }
+    printf("%d: Message: %.*s (%ld bytes, sealed)\n", i, (int)st.st_size, message, st.st_size);
+    munmap((void*)message, st.st_size);
+    close(memfd);
+  }
+  close(sockfd);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  // -s: receive sealed memfds, one per message, instead of the ring.
+  int sealed = argc > 1 && !strcmp(argv[1], "-s");
+
   // create socket
   int sockfd = socket(AF_UNIX, SOCK_DGRAM, 0);
   if (sockfd < 0) {
@@ -34,42 +100,42 @@ int main() {
     return 1;
   }
 
-  char iov_dummy;
-  struct iovec iov = { 
-    .iov_base = &iov_dummy, 
-    .iov_len = sizeof(char) 
-  };
-  char buff[CMSG_SPACE(sizeof(int))];
-
-  struct msghdr msg = {
-    .msg_name = 0,
-    .msg_namelen = 0,
-    .msg_iov = &iov,
-    .msg_iovlen = 1,
-    .msg_control = &buff,
-    .msg_controllen = sizeof(buff),
-    .msg_flags = 0,
-  };
+  if (sealed)
+    return sealed_handoff(sockfd);
 
   printf("waiting for message..\n");
-  int n = recvmsg(sockfd, &msg, 0);
-  printf("Received: %d bytes\n", n);
-
-  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-  int memfd = *(int*)CMSG_DATA(cmsg); // receive file descriptor
-
+  int memfd = get_fd(sockfd);
   printf("memfd: %d\n", memfd);
 
-  char* memfd_map = (char*)mmap(0, SIZE, PROT_READ, MAP_PRIVATE, memfd, 0);
+  // Shared and writable: consuming a record moves the ring tail.
+  char* memfd_map = (char*)mmap(0, SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
   if (memfd_map == MAP_FAILED) {
     printf("memfd map failed\n");
     return 1;
   }
   printf("memfd_map: %p\n", memfd_map);
 
-  for (int i = 0; i < 10; i++) {
-    printf("%d: Message: %s\n", i, memfd_map);
-    sleep(1);
+  struct doorbell* data_bell = (struct doorbell*)memfd_map;
+  struct doorbell* space_bell = data_bell + 1;
+  struct shm_ring ring;
+  if (shm_ring_attach(&ring, memfd_map + RING_OFFSET) < 0) {
+    printf("no ring in the memfd\n");
+    return 1;
+  }
+
+  for (int i = 0; i < NUM_MESSAGES; ) {
+    // Sample the doorbell before looking, so a record published in
+    // between still wakes us.
+    uint32_t seen = doorbell_seq(data_bell);
+    char message[256];
+    int64_t len = shm_ring_recv(&ring, message, sizeof(message) - 1);
+    if (len < 0) {
+      doorbell_wait(data_bell, seen, -1);
+      continue;
+    }
+    doorbell_ring(space_bell);
+    message[len] = 0;
+    printf("%d: Message: %s (%ld bytes)\n", i++, message, len);
   }
 
   munmap(memfd_map, SIZE);
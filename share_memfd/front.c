@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -9,29 +10,75 @@
 #include <sys/syscall.h>
 #include <linux/memfd.h>
 
-static int SIZE = 300;
+#include "../common/doorbell.h"
+#include "../common/memfd_pool.h"
+#include "../common/shm_ring.h"
+
+// The first page of the memfd holds the doorbells, the rest is one
+// shm_ring: front produces and back consumes.
+static int SIZE = 64 * 1024;
+static int RING_OFFSET = 4096;
+static int NUM_MESSAGES = 10;
 static char* SERVER_SOCKET_PATH = "test_socket";
 
-int main() {
-  int memfd = syscall(SYS_memfd_create, "memfd_test", 0);
-  if (memfd < 0) {
-    printf("memfd failed\n");
-    return 1;
-  }
-  printf("memfd: %d\n", memfd);
+void send_fd(int sockfd, int fd) {
+  char iov_dummy = 'A';
+  struct iovec iov = {
+    .iov_base = &iov_dummy,
+    .iov_len = sizeof(char),
+  };
+  char buff[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg = {
+    .msg_name = 0,
+    .msg_namelen = 0,
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = &buff,
+    .msg_controllen = sizeof(buff),
+    .msg_flags = 0,
+  };
 
-  int r = ftruncate(memfd, SIZE);
-  if (r < 0) {
-    printf("memfd failed\n");
-    return 1;
-  }
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  int* data = (int*)CMSG_DATA(cmsg);
+  memcpy(data, &fd, sizeof(int));
 
-  char* memfd_map = (char*)mmap(0, SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
-  if (memfd_map == MAP_FAILED) {
-    printf("memfd map failed\n");
+  sendmsg(sockfd, &msg, 0);
+}
+
+// Every message goes out as its own memfd, taken from a pool of
+// populated buffers, written and sealed before it is sent.
+int sealed_handoff(int sockfd) {
+  struct memfd_pool pool;
+  if (memfd_pool_init(&pool, 4096, 4) < 0) {
+    perror("memfd pool failed");
     return 1;
   }
-  printf("memfd_map: %p\n", memfd_map);
+  for (int i = 0; i < NUM_MESSAGES; i++) {
+    struct memfd_buf buf;
+    if (memfd_pool_get(&pool, &buf) < 0) {
+      perror("memfd failed");
+      return 1;
+    }
+    int len = sprintf(buf.map, "Lol %d", i);
+    if (memfd_buf_seal(&buf, len) < 0) {
+      perror("seal failed");
+      return 1;
+    }
+    send_fd(sockfd, buf.fd);
+    close(buf.fd);
+    printf("sent sealed: Lol %d\n", i);
+  }
+  memfd_pool_destroy(&pool);
+  close(sockfd);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  // -s: hand every message over as a sealed memfd instead of the ring.
+  int sealed = argc > 1 && !strcmp(argv[1], "-s");
 
   // create socket
   int sockfd = socket(AF_UNIX, SOCK_DGRAM, 0);
@@ -50,36 +97,54 @@ int main() {
     return 1;
   }
 
-  char iov_dummy = 'A';
-  struct iovec iov = {
-    .iov_base = &iov_dummy,
-    .iov_len = sizeof(char),
-  };
-  char buff[CMSG_SPACE(sizeof(int))];
-  struct msghdr msg = {
-    .msg_name = 0,
-    .msg_namelen = 0,
-    .msg_iov = &iov,
-    .msg_iovlen = 1,
-    .msg_control = &buff,
-    .msg_controllen = sizeof(buff),
-    .msg_flags = 0,
-  };
+  if (sealed)
+    return sealed_handoff(sockfd);
 
-  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-  cmsg->cmsg_level = SOL_SOCKET;
-  cmsg->cmsg_type = SCM_RIGHTS;
-  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
-  int* data = (int*)CMSG_DATA(cmsg);
-  memcpy(data, &memfd, sizeof(int));
+  int memfd = syscall(SYS_memfd_create, "memfd_test", 0);
+  if (memfd < 0) {
+    printf("memfd failed\n");
+    return 1;
+  }
+  printf("memfd: %d\n", memfd);
+
+  int r = ftruncate(memfd, SIZE);
+  if (r < 0) {
+    printf("memfd failed\n");
+    return 1;
+  }
+
+  char* memfd_map = (char*)mmap(0, SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (memfd_map == MAP_FAILED) {
+    printf("memfd map failed\n");
+    return 1;
+  }
+  printf("memfd_map: %p\n", memfd_map);
+
+  // data: rung by front after every record. space: rung by back after
+  // consuming one.
+  struct doorbell* data_bell = (struct doorbell*)memfd_map;
+  struct doorbell* space_bell = data_bell + 1;
+  struct shm_ring ring;
+  if (shm_ring_init(&ring, memfd_map + RING_OFFSET, SIZE - RING_OFFSET) < 0) {
+    printf("ring init failed\n");
+    return 1;
+  }
 
   printf("sending FD: %d\n", memfd);
-  sendmsg(sockfd, &msg, 0);
+  send_fd(sockfd, memfd);
 
-  printf("sleeping\n");
-  for (int i = 0; i < 10; i++) {
-    sprintf(memfd_map, "Lol %d", i);
-    sleep(1);
+  // Every message is its own record, back sees each one exactly once.
+  for (int i = 0; i < NUM_MESSAGES; i++) {
+    char message[32];
+    int len = sprintf(message, "Lol %d", i);
+    for (;;) {
+      uint32_t seen = doorbell_seq(space_bell);
+      if (shm_ring_send(&ring, message, len + 1) == 0)
+        break;
+      doorbell_wait(space_bell, seen, -1);
+    }
+    doorbell_ring(data_bell);
+    printf("sent: %s\n", message);
   }
 
   munmap(memfd_map, SIZE);
@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
+
+#include "../common/shm_ring.h"
+#include "../common/timing.h"
+
+// Throughput and latency of common/shm_ring.h between two processes
+// sharing a memfd. The parent produces into ring 0, the forked child
+// consumes it; for latency the child echoes every message back on
+// ring 1 and half the round trip is recorded.
+
+// 4 MiB of data per ring, records up to 2 MiB.
+#define RING_SIZE (4 * 1024 * 1024 + 4096)
+#define MAX_MESSAGE (1024 * 1024)
+
+static const uint64_t sizes[] = { 64, 256, 1024, 4096, 16384, 65536, 262144, 1048576 };
+#define NUM_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+// Per size: at least this many messages and this many bytes.
+static uint64_t min_messages = 10000;
+static uint64_t min_bytes = 256 * 1024 * 1024;
+static int round_trips = 2000;
+
+static uint64_t messages_for(uint64_t size) {
+  uint64_t n = min_bytes / size;
+  return n > min_messages ? n : min_messages;
+}
+
+static void send_blocking(struct shm_ring* r, const char* buf, uint64_t len) {
+  while (shm_ring_send(r, buf, len) < 0)
+    sched_yield();
+}
+
+static void recv_blocking(struct shm_ring* r, char* buf) {
+  while (shm_ring_recv(r, buf, MAX_MESSAGE) < 0)
+    sched_yield();
+}
+
+void consumer(char* map) {
+  struct shm_ring rings[2];
+  if (shm_ring_attach(&rings[0], map) < 0 || shm_ring_attach(&rings[1], map + RING_SIZE) < 0) {
+    printf("ring attach failed\n");
+    exit(EXIT_FAILURE);
+  }
+  char* buf = malloc(MAX_MESSAGE);
+  for (int s = 0; s < NUM_SIZES; s++) {
+    uint64_t n = messages_for(sizes[s]);
+    // Messages carry their sequence number, so lost, repeated or torn
+    // records show up.
+    for (uint64_t i = 0; i < n; i++) {
+      recv_blocking(&rings[0], buf);
+      if (*(uint64_t*)buf != i || buf[sizes[s] - 1] != 'A') {
+        printf("size %lu: message %lu is corrupt\n", sizes[s], i);
+        exit(EXIT_FAILURE);
+      }
+    }
+    for (int i = 0; i < round_trips; i++) {
+      recv_blocking(&rings[0], buf);
+      send_blocking(&rings[1], buf, sizes[s]);
+    }
+  }
+  exit(0);
+}
+
+int main(int argc, char** argv) {
+  int memfd = syscall(SYS_memfd_create, "ring_bench", 0);
+  if (memfd < 0) {
+    printf("memfd failed\n");
+    return 1;
+  }
+  if (ftruncate(memfd, 2 * RING_SIZE) < 0) {
+    printf("memfd failed\n");
+    return 1;
+  }
+  char* map = (char*)mmap(0, 2 * RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (map == MAP_FAILED) {
+    printf("memfd map failed\n");
+    return 1;
+  }
+
+  struct shm_ring rings[2];
+  shm_ring_init(&rings[0], map, RING_SIZE);
+  shm_ring_init(&rings[1], map + RING_SIZE, RING_SIZE);
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork failed");
+    return 1;
+  }
+  if (pid == 0)
+    consumer(map);
+
+  char* buf = malloc(MAX_MESSAGE);
+  memset(buf, 'A', MAX_MESSAGE);
+  printf("%-10s %12s %12s %12s %12s %12s\n", "size", "MB/s", "msgs/s", "p50", "p99", "max");
+  for (int s = 0; s < NUM_SIZES; s++) {
+    uint64_t size = sizes[s];
+    uint64_t n = messages_for(size);
+
+    // Done once the consumer has caught up with everything we sent.
+    uint64_t before = timing_now();
+    for (uint64_t i = 0; i < n; i++) {
+      *(uint64_t*)buf = i;
+      send_blocking(&rings[0], buf, size);
+    }
+    while (__atomic_load_n(&rings[0].hdr->tail, __ATOMIC_ACQUIRE) !=
+           __atomic_load_n(&rings[0].hdr->head, __ATOMIC_RELAXED))
+      sched_yield();
+    uint64_t elapsed = timing_now() - before;
+
+    struct histogram latency;
+    hist_init(&latency, "one way");
+    for (int i = 0; i < round_trips; i++) {
+      uint64_t start = timing_now();
+      send_blocking(&rings[0], buf, size);
+      recv_blocking(&rings[1], buf);
+      hist_record(&latency, (timing_now() - start) / 2);
+    }
+
+    char p50[32], p99[32], max[32];
+    hist_format(p50, sizeof(p50), hist_percentile(&latency, 50));
+    hist_format(p99, sizeof(p99), hist_percentile(&latency, 99));
+    hist_format(max, sizeof(max), latency.max);
+    printf("%-10lu %12.1f %12.0f %12s %12s %12s\n", size, n * size * 1e3 / elapsed,
+           n * 1e9 / elapsed, p50, p99, max);
+  }
+
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+    printf("consumer failed\n");
+    return 1;
+  }
+  munmap(map, 2 * RING_SIZE);
+  close(memfd);
+  return 0;
+}
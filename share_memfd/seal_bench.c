@@ -0,0 +1,178 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+
+#include "../common/memfd_pool.h"
+#include "../common/timing.h"
+
+// Cost of handing messages over as sealed memfds (common/memfd_pool.h)
+// to a forked receiver. Per message size, the sender either creates a
+// new memfd for every message or takes one from the pool; the time from
+// getting a buffer to sending its fd is recorded. The receiver checks
+// the seals and the contents in place, without copying.
+
+static const uint64_t sizes[] = { 4096, 65536, 1048576, 4194304 };
+#define NUM_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+#define POOL_BUFFERS 16
+
+static uint64_t messages_for(uint64_t size) {
+  uint64_t n = 256 * 1024 * 1024 / size;
+  return n < 200 ? 200 : n > 2000 ? 2000 : n;
+}
+
+void send_fd(int sockfd, int fd) {
+  char iov_dummy = 'A';
+  struct iovec iov = {
+    .iov_base = &iov_dummy,
+    .iov_len = sizeof(char),
+  };
+  char buff[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg = {
+    .msg_name = 0,
+    .msg_namelen = 0,
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = &buff,
+    .msg_controllen = sizeof(buff),
+    .msg_flags = 0,
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  if (sendmsg(sockfd, &msg, 0) < 0) {
+    perror("sendmsg failed");
+    exit(EXIT_FAILURE);
+  }
+}
+
+int get_fd(int sockfd) {
+  char iov_dummy;
+  struct iovec iov = {
+    .iov_base = &iov_dummy,
+    .iov_len = sizeof(char),
+  };
+  char buff[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg = {
+    .msg_name = 0,
+    .msg_namelen = 0,
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = &buff,
+    .msg_controllen = sizeof(buff),
+    .msg_flags = 0,
+  };
+  if (recvmsg(sockfd, &msg, 0) < 0)
+    return -1;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS)
+    return -1;
+  int fd;
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  return fd;
+}
+
+// Both modes for every size, in the order the sender sends them.
+void receiver(int sockfd) {
+  for (int s = 0; s < NUM_SIZES; s++) {
+    for (int mode = 0; mode < 2; mode++) {
+      for (uint64_t i = 0; i < messages_for(sizes[s]); i++) {
+        int fd = get_fd(sockfd);
+        struct stat st;
+        if (fd < 0 || memfd_check_seals(fd) < 0 || fstat(fd, &st) < 0 || st.st_size != sizes[s]) {
+          printf("size %lu: message %lu is not a sealed memfd of the right size\n", sizes[s], i);
+          exit(EXIT_FAILURE);
+        }
+        const char* map = (const char*)mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED || *(uint64_t*)map != i || map[st.st_size - 1] != 'A') {
+          printf("size %lu: message %lu is corrupt\n", sizes[s], i);
+          exit(EXIT_FAILURE);
+        }
+        munmap((void*)map, st.st_size);
+        close(fd);
+      }
+    }
+  }
+  exit(0);
+}
+
+// Fill a buffer of `size` bytes as message `i`.
+static void fill(char* map, uint64_t size, uint64_t i) {
+  memset(map, 'A', size);
+  *(uint64_t*)map = i;
+}
+
+int main(int argc, char** argv) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) < 0) {
+    perror("socketpair failed");
+    return 1;
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork failed");
+    return 1;
+  }
+  if (pid == 0) {
+    close(sv[0]);
+    receiver(sv[1]);
+  }
+  close(sv[1]);
+
+  printf("%-10s %-8s %12s %12s %12s %12s\n", "size", "buffers", "msgs/s", "p50", "p99", "max");
+  for (int s = 0; s < NUM_SIZES; s++) {
+    uint64_t size = sizes[s];
+    uint64_t n = messages_for(size);
+    for (int mode = 0; mode < 2; mode++) {
+      struct memfd_pool pool;
+      if (mode == 1 && memfd_pool_init(&pool, size, POOL_BUFFERS) < 0) {
+        perror("memfd pool failed");
+        return 1;
+      }
+      struct histogram handoff;
+      hist_init(&handoff, "handoff");
+      uint64_t before = timing_now();
+      for (uint64_t i = 0; i < n; i++) {
+        uint64_t start = timing_now();
+        struct memfd_buf buf;
+        if ((mode == 1 ? memfd_pool_get(&pool, &buf) : memfd_buf_create(&buf, size)) < 0) {
+          perror("memfd failed");
+          return 1;
+        }
+        fill(buf.map, size, i);
+        if (memfd_buf_seal(&buf, size) < 0) {
+          perror("seal failed");
+          return 1;
+        }
+        send_fd(sv[0], buf.fd);
+        close(buf.fd);
+        hist_record(&handoff, timing_now() - start);
+      }
+      uint64_t elapsed = timing_now() - before;
+      if (mode == 1)
+        memfd_pool_destroy(&pool);
+
+      char p50[32], p99[32], max[32];
+      hist_format(p50, sizeof(p50), hist_percentile(&handoff, 50));
+      hist_format(p99, sizeof(p99), hist_percentile(&handoff, 99));
+      hist_format(max, sizeof(max), handoff.max);
+      printf("%-10lu %-8s %12.0f %12s %12s %12s\n", size, mode ? "pool" : "create",
+             n * 1e9 / elapsed, p50, p99, max);
+    }
+  }
+
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+    printf("receiver failed\n");
+    return 1;
+  }
+  close(sv[0]);
+  return 0;
+}
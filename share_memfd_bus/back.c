@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
+
+#include "../common/shm_bus.h"
+
+// Start as many as front waits for, in any order.
+static char* SERVER_SOCKET_PATH = "test_socket_bus";
+
+struct bus_setup {
+  int32_t consumer;
+  int32_t producers;
+};
+
+int get_bus(int sockfd, struct bus_setup* setup) {
+  struct iovec iov = {
+    .iov_base = setup,
+    .iov_len = sizeof(*setup),
+  };
+  char buff[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg = {
+    .msg_name = 0,
+    .msg_namelen = 0,
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = &buff,
+    .msg_controllen = sizeof(buff),
+    .msg_flags = 0,
+  };
+
+  printf("waiting for message..\n");
+  int n = recvmsg(sockfd, &msg, 0);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (n != sizeof(*setup) || !cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+    printf("bad setup message\n");
+    exit(EXIT_FAILURE);
+  }
+  int memfd;
+  memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+  return memfd;
+}
+
+int main() {
+  int sockfd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (sockfd < 0) {
+    printf("sockfd failed\n");
+    return 1;
+  }
+
+  struct sockaddr_un server_addr;
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sun_family = AF_UNIX;
+  strncpy(server_addr.sun_path, SERVER_SOCKET_PATH, sizeof(server_addr.sun_path) - 1);
+
+  if (connect(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+    perror("connect failed");
+    return 1;
+  }
+
+  struct bus_setup setup;
+  int memfd = get_bus(sockfd, &setup);
+  printf("memfd: %d, consumer %d of a bus with %d producers\n", memfd, setup.consumer,
+         setup.producers);
+
+  struct stat st;
+  if (fstat(memfd, &st) < 0) {
+    perror("memfd fstat failed");
+    return 1;
+  }
+  // Shared and writable: reading a message moves our cursor.
+  char* memfd_map = (char*)mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (memfd_map == MAP_FAILED) {
+    printf("memfd map failed\n");
+    return 1;
+  }
+
+  struct shm_bus bus;
+  if (shm_bus_attach(&bus, memfd_map, setup.consumer) < 0) {
+    printf("no bus in the memfd\n");
+    return 1;
+  }
+
+  // Every producer ends with an empty message.
+  int received = 0;
+  for (int done = 0; done < setup.producers; ) {
+    char message[256];
+    int64_t len = shm_bus_recv_wait(&bus, message, sizeof(message) - 1);
+    if (len < 0) {
+      perror("recv failed");
+      return 1;
+    }
+    if (len == 0) {
+      done++;
+      continue;
+    }
+    message[len] = 0;
+    printf("%d: Message: %s (%ld bytes)\n", received++, message, len);
+  }
+  shm_bus_leave(&bus);
+  printf("consumer %d received %d messages\n", setup.consumer, received);
+
+  munmap(memfd_map, st.st_size);
+  close(memfd);
+  close(sockfd);
+}
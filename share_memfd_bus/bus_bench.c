@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
+
+#include "../common/shm_bus.h"
+#include "../common/timing.h"
+
+// Scaling of common/shm_bus.h with the number of consumers. For 1, 2,
+// 4, ... consumers a fresh bus is created, the consumers and producers
+// are forked, and the producers send the same total number of messages
+// every run. Every consumer reads all of them and checks that each
+// producer's messages arrive complete and in order.
+
+struct message {
+  uint32_t producer;
+  uint32_t reserved;
+  uint64_t count;
+  uint64_t stamp;
+};
+
+// Per consumer, in a shared mapping the parent reads after the run.
+struct result {
+  struct histogram latency;
+  uint64_t received;
+  int failed;
+};
+
+static int max_consumers = 32;
+static int producers = 1;
+static uint64_t messages = 200000;
+static uint64_t message_size = 64;
+static uint64_t slots = 1024;
+
+void consumer(char* map, int index, struct result* result) {
+  struct shm_bus bus;
+  if (shm_bus_attach(&bus, map, index) < 0) {
+    result->failed = 1;
+    exit(EXIT_FAILURE);
+  }
+  uint64_t expected[producers];
+  memset(expected, 0, sizeof(expected));
+  char* buf = malloc(message_size);
+  hist_init(&result->latency, "latency");
+  for (int done = 0; done < producers; ) {
+    int64_t len = shm_bus_recv_wait(&bus, buf, message_size);
+    uint64_t now = timing_now();
+    if (len == 0) {
+      done++;
+      continue;
+    }
+    struct message* m = (struct message*)buf;
+    if (len != message_size || m->producer >= producers || m->count != expected[m->producer]) {
+      printf("consumer %d: message %lu is corrupt or out of order\n", index, result->received);
+      result->failed = 1;
+      exit(EXIT_FAILURE);
+    }
+    expected[m->producer]++;
+    hist_record(&result->latency, now - m->stamp);
+    result->received++;
+  }
+  shm_bus_leave(&bus);
+  exit(0);
+}
+
+void producer(char* map, int index, uint64_t count, struct doorbell* go) {
+  struct shm_bus bus;
+  if (shm_bus_attach(&bus, map, -1) < 0)
+    exit(EXIT_FAILURE);
+  char* buf = calloc(1, message_size);
+  struct message* m = (struct message*)buf;
+  m->producer = index;
+  doorbell_wait(go, 0, -1);
+  for (uint64_t i = 0; i < count; i++) {
+    m->count = i;
+    m->stamp = timing_now();
+    shm_bus_send_wait(&bus, buf, message_size);
+  }
+  shm_bus_send_wait(&bus, "", 0);
+  exit(0);
+}
+
+// One run with `consumers` consumers. Returns 0 when every consumer
+// got every message.
+int run(int consumers) {
+  uint64_t size = shm_bus_size(slots, message_size);
+  int memfd = syscall(SYS_memfd_create, "bus_bench", 0);
+  if (memfd < 0 || ftruncate(memfd, size) < 0) {
+    printf("memfd failed\n");
+    return -1;
+  }
+  char* map = (char*)mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (map == MAP_FAILED) {
+    printf("memfd map failed\n");
+    return -1;
+  }
+  struct shm_bus bus;
+  if (shm_bus_init(&bus, map, slots, message_size, consumers) < 0) {
+    printf("bus init failed\n");
+    return -1;
+  }
+
+  // The go doorbell sits after the results.
+  uint64_t shared_size = consumers * sizeof(struct result) + sizeof(struct doorbell);
+  struct result* results = (struct result*)mmap(0, shared_size, PROT_READ | PROT_WRITE,
+                                                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (results == MAP_FAILED) {
+    perror("results map failed");
+    return -1;
+  }
+  struct doorbell* go = (struct doorbell*)(results + consumers);
+
+  fflush(stdout);
+  for (int i = 0; i < consumers + producers; i++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork failed");
+      exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+      if (i < consumers)
+        consumer(map, i, &results[i]);
+      // The first producers send one message more when they do not divide evenly.
+      int p = i - consumers;
+      producer(map, p, messages / producers + (p < messages % producers), go);
+    }
+  }
+
+  uint64_t before = timing_now();
+  doorbell_ring(go);
+  int failed = 0;
+  int status;
+  while (wait(&status) > 0) {
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+      failed = 1;
+  }
+  uint64_t elapsed = timing_now() - before;
+
+  struct histogram latency;
+  hist_init(&latency, "latency");
+  for (int i = 0; i < consumers; i++) {
+    if (results[i].failed || results[i].received != messages)
+      failed = 1;
+    hist_merge(&latency, &results[i].latency);
+  }
+  if (!failed) {
+    char p50[32], p99[32], max[32];
+    hist_format(p50, sizeof(p50), hist_percentile(&latency, 50));
+    hist_format(p99, sizeof(p99), hist_percentile(&latency, 99));
+    hist_format(max, sizeof(max), latency.max);
+    printf("%-10d %12.0f %14.0f %12.1f %12s %12s %12s\n", consumers, messages * 1e9 / elapsed,
+           messages * consumers * 1e9 / elapsed, messages * consumers * message_size * 1e3 / elapsed,
+           p50, p99, max);
+  }
+
+  munmap(results, shared_size);
+  munmap(map, size);
+  close(memfd);
+  return failed ? -1 : 0;
+}
+
+void usage(const char* name) {
+  printf("Usage: %s [-c consumers] [-p producers] [-m messages] [-s bytes] [-n slots]\n", name);
+  printf("  -c  max consumers, runs 1, 2, 4, ... up to it (default %d, max %d)\n", max_consumers,
+         SHM_BUS_MAX_CONSUMERS);
+  printf("  -p  producer processes (default %d)\n", producers);
+  printf("  -m  messages per run, over all producers (default %lu)\n", messages);
+  printf("  -s  message size in bytes (default %lu, min %lu)\n", message_size,
+         sizeof(struct message));
+  printf("  -n  bus slots, a power of two (default %lu)\n", slots);
+}
+
+int main(int argc, char** argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "c:p:m:s:n:h")) != -1) {
+    switch (opt) {
+      case 'c':
+        max_consumers = atoi(optarg);
+        break;
+      case 'p':
+        producers = atoi(optarg);
+        break;
+      case 'm':
+        messages = strtoull(optarg, NULL, 0);
+        break;
+      case 's':
+        message_size = strtoull(optarg, NULL, 0);
+        break;
+      case 'n':
+        slots = strtoull(optarg, NULL, 0);
+        break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (max_consumers < 1 || max_consumers > SHM_BUS_MAX_CONSUMERS || producers < 1 ||
+      message_size < sizeof(struct message)) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  printf("%d producers, %lu messages of %lu bytes, %lu slots\n", producers, messages, message_size,
+         slots);
+  printf("%-10s %12s %14s %12s %12s %12s %12s\n", "consumers", "msgs/s", "deliveries/s",
+         "MB/s", "p50", "p99", "max");
+  for (int c = 1; ; c *= 2) {
+    if (c > max_consumers)
+      c = max_consumers;
+    if (run(c) < 0) {
+      printf("%d consumers: run failed\n", c);
+      return 1;
+    }
+    if (c == max_consumers)
+      break;
+  }
+  return 0;
+}
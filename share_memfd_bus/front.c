@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
+
+#include "../common/shm_bus.h"
+
+// The memfd holds one shm_bus. Front creates it, hands it to every
+// backend that connects and then produces into it from one or more
+// processes; every backend reads every message.
+static int NUM_SLOTS = 256;
+static int MAX_MESSAGE = 64;
+static char* SERVER_SOCKET_PATH = "test_socket_bus";
+
+// Sent along with the memfd to every backend.
+struct bus_setup {
+  int32_t consumer;
+  int32_t producers;
+};
+
+void send_bus(int sockfd, int memfd, struct bus_setup* setup) {
+  struct iovec iov = {
+    .iov_base = setup,
+    .iov_len = sizeof(*setup),
+  };
+  char buff[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg = {
+    .msg_name = 0,
+    .msg_namelen = 0,
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = &buff,
+    .msg_controllen = sizeof(buff),
+    .msg_flags = 0,
+  };
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+  if (sendmsg(sockfd, &msg, 0) < 0) {
+    perror("sendmsg failed");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Every producer sends `messages` of its own, then an empty message:
+// a backend is done once it has seen one from every producer.
+void produce(struct shm_bus* bus, int producer, int messages) {
+  for (int i = 0; i < messages; i++) {
+    char message[64];
+    int len = sprintf(message, "producer %d: Lol %d", producer, i);
+    if (shm_bus_send_wait(bus, message, len + 1) < 0) {
+      perror("send failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+  shm_bus_send_wait(bus, "", 0);
+}
+
+void usage(const char* name) {
+  printf("Usage: %s [-n backends] [-p producers] [-m messages]\n", name);
+  printf("  -n  backends to wait for (default 2, max %d)\n", SHM_BUS_MAX_CONSUMERS);
+  printf("  -p  producer processes (default 1)\n");
+  printf("  -m  messages per producer (default 10)\n");
+}
+
+int main(int argc, char** argv) {
+  int backends = 2;
+  int producers = 1;
+  int messages = 10;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:p:m:h")) != -1) {
+    switch (opt) {
+      case 'n':
+        backends = atoi(optarg);
+        break;
+      case 'p':
+        producers = atoi(optarg);
+        break;
+      case 'm':
+        messages = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (backends < 1 || backends > SHM_BUS_MAX_CONSUMERS || producers < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  int memfd = syscall(SYS_memfd_create, "memfd_bus", 0);
+  if (memfd < 0) {
+    printf("memfd failed\n");
+    return 1;
+  }
+  printf("memfd: %d\n", memfd);
+
+  uint64_t size = shm_bus_size(NUM_SLOTS, MAX_MESSAGE);
+  if (ftruncate(memfd, size) < 0) {
+    printf("memfd failed\n");
+    return 1;
+  }
+
+  char* memfd_map = (char*)mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (memfd_map == MAP_FAILED) {
+    printf("memfd map failed\n");
+    return 1;
+  }
+  printf("memfd_map: %p\n", memfd_map);
+
+  struct shm_bus bus;
+  if (shm_bus_init(&bus, memfd_map, NUM_SLOTS, MAX_MESSAGE, backends) < 0) {
+    printf("bus init failed\n");
+    return 1;
+  }
+
+  // Backends connect one by one, each gets its own connection, so
+  // nobody has to unlink and bind the socket again.
+  int sockfd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (sockfd < 0) {
+    printf("sockfd failed\n");
+    return 1;
+  }
+
+  struct sockaddr_un server_addr;
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sun_family = AF_UNIX;
+  strncpy(server_addr.sun_path, SERVER_SOCKET_PATH, sizeof(server_addr.sun_path) - 1);
+
+  unlink(SERVER_SOCKET_PATH);
+  if (bind(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0 ||
+      listen(sockfd, backends) < 0) {
+    perror("bind failed");
+    return 1;
+  }
+
+  for (int i = 0; i < backends; i++) {
+    printf("waiting for backend %d of %d\n", i + 1, backends);
+    int connfd = accept(sockfd, NULL, NULL);
+    if (connfd < 0) {
+      perror("accept failed");
+      return 1;
+    }
+    struct bus_setup setup = { .consumer = i, .producers = producers };
+    send_bus(connfd, memfd, &setup);
+    close(connfd);
+  }
+  unlink(SERVER_SOCKET_PATH);
+
+  // Producers beyond the first are forked and share the mapping.
+  fflush(stdout);
+  for (int p = 1; p < producers; p++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork failed");
+      return 1;
+    }
+    if (pid == 0) {
+      produce(&bus, p, messages);
+      exit(0);
+    }
+  }
+  produce(&bus, 0, messages);
+  while (wait(NULL) > 0)
+    ;
+  printf("sent %d messages from %d producers to %d backends\n", messages * producers, producers,
+         backends);
+
+  munmap(memfd_map, size);
+  close(memfd);
+  close(sockfd);
+}
@@ -8,6 +8,8 @@
 #include <sys/syscall.h>
 #include <linux/memfd.h>
 
+#include "../common/doorbell.h"
+
 static int PAGE_SIZE = 4096;
 static int SIZE = 8192;
 static char* SERVER_SOCKET_PATH = "test_socket";
@@ -66,14 +68,25 @@ int main() {
   }
   printf("memfd_map: %p\n", memfd_map);
 
-  // sleep to give time for frontend to make an uffd page fault
-  sleep(1);
+  // Wait for front's uffd page fault: it rings the doorbell in the
+  // page after the data.
+  struct doorbell* faulted = (struct doorbell*)mmap(0, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                                    memfd, SIZE);
+  if (faulted == MAP_FAILED) {
+    printf("doorbell map failed\n");
+    return 1;
+  }
+  if (doorbell_wait(faulted, 0, 10000) < 0) {
+    printf("front did not fault within 10 seconds\n");
+    return 1;
+  }
   printf("Reading first 10 bytes\n");
   printf("Message: %.*s\n", 10, memfd_map);
 
   printf("Reading first 10 bytes of second page\n");
   printf("Message: %.*s\n", 10, memfd_map + PAGE_SIZE);
 
+  munmap(faulted, PAGE_SIZE);
   munmap(memfd_map, SIZE);
   close(sockfd);
 }
@@ -2,6 +2,7 @@
 #include <poll.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <inttypes.h>
@@ -15,10 +16,21 @@
 #include <linux/memfd.h>
 #include <linux/userfaultfd.h>
 
+#include "../common/doorbell.h"
+#include "../common/trace.h"
+
 static int PAGE_SIZE = 4096;
+// The memfd is SIZE bytes of data registered with the uffd, plus one
+// page after it for the doorbell, which must never fault.
 static int SIZE = 8192;
 static char* SERVER_SOCKET_PATH = "test_socket";
 
+// Max number of messages drained from the uffd with one read().
+// Build with -DMSGS_PER_READ=1 to read a single message per call.
+#ifndef MSGS_PER_READ
+#define MSGS_PER_READ 16
+#endif
+
 void* fault_handler_thread(void *arg) {
   printf("Running uffd thread\n");
   int uffd = (int)arg;
@@ -31,68 +43,87 @@ void* fault_handler_thread(void *arg) {
   }
 
   int fault_cnt = 0;
+  // poll() and read() calls so far
+  unsigned long syscalls = 0;
+  struct uffd_msg msgs[MSGS_PER_READ];
   for (;;) {
       struct pollfd pollfd;
       pollfd.fd = uffd;
       pollfd.events = POLLIN;
       int nready = poll(&pollfd, 1, -1);
+      syscalls++;
       if (nready == -1) {
         printf("poll failed\n");
         exit(EXIT_FAILURE);
       }
 
-      printf("\nfault_handler_thread():\n");
-      printf("    poll() returns: nready = %d; "
-             "POLLIN = %d; POLLERR = %d\n", nready,
-             (pollfd.revents & POLLIN) != 0,
-             (pollfd.revents & POLLERR) != 0);
-
-      // Read an event from the userfaultfd.
-      struct uffd_msg msg;
-      int nread = read(uffd, &msg, sizeof(msg));
-      if (nread == 0) {
-          printf("uffd thread read empty: EOF\n");
-          exit(EXIT_FAILURE);
-      }
+      trace(TRACE_POLL, uffd, 0, pollfd.revents, nready);
 
-      if (nread == -1){
-        printf("uffd thread read failed\n");
-        exit(EXIT_FAILURE);
-      }
+      // Drain the userfaultfd, reading up to MSGS_PER_READ events
+      // per read(), and resolve the whole batch before going
+      // back to poll().
+      int batch_faults = 0;
+      for (;;) {
+          int nread = read(uffd, msgs, sizeof(msgs));
+          syscalls++;
+          if (nread == 0) {
+              printf("uffd thread read empty: EOF\n");
+              exit(EXIT_FAILURE);
+          }
 
-      // We expect only one kind of event; verify that assumption.
-      if (msg.event != UFFD_EVENT_PAGEFAULT) {
-          printf("Unexpected event on userfaultfd\n");
-          exit(EXIT_FAILURE);
-      }
+          if (nread == -1) {
+            if (errno == EAGAIN)
+              break;
+            printf("uffd thread read failed\n");
+            exit(EXIT_FAILURE);
+          }
+
+          int nmsgs = nread / sizeof(struct uffd_msg);
+          for (int i = 0; i < nmsgs; i++) {
+              struct uffd_msg* msg = &msgs[i];
+
+              // We expect only one kind of event; verify that assumption.
+              if (msg->event != UFFD_EVENT_PAGEFAULT) {
+                  printf("Unexpected event on userfaultfd\n");
+                  exit(EXIT_FAILURE);
+              }
+
+              // Record the page-fault event, decoded off this thread.
+              trace(TRACE_FAULT, uffd, msg->arg.pagefault.address,
+                    msg->arg.pagefault.flags, 0);
 
-      // Display info about the page-fault event.
-      printf("    UFFD_EVENT_PAGEFAULT event: ");
-      printf("flags = %"PRIx64"; ", msg.arg.pagefault.flags);
-      printf("address = %"PRIx64"\n", msg.arg.pagefault.address);
-
-      // Copy the page pointed to by 'page' into the faulting
-      // region. Vary the contents that are copied in, so that it
-      // is more obvious that each fault is handled separately.
-      memset(page, 'A' + fault_cnt % 20, PAGE_SIZE);
-      fault_cnt++;
-
-      struct uffdio_copy uffdio_copy;
-      uffdio_copy.src = (unsigned long) page;
-
-      // We need to handle page faults in units of pages(!).
-      // So, round faulting address down to page boundary
-      uffdio_copy.dst = (unsigned long) msg.arg.pagefault.address & ~(PAGE_SIZE - 1);
-      uffdio_copy.len = PAGE_SIZE;
-      uffdio_copy.mode = 0;
-      uffdio_copy.copy = 0;
-      if (ioctl(uffd, UFFDIO_COPY, &uffdio_copy) == -1) {
-          printf("UFFDIO_COPY failed\n");
-          exit(EXIT_FAILURE);
+              // Copy the page pointed to by 'page' into the faulting
+              // region. Vary the contents that are copied in, so that it
+              // is more obvious that each fault is handled separately.
+              memset(page, 'A' + fault_cnt % 20, PAGE_SIZE);
+              fault_cnt++;
+              batch_faults++;
+
+              struct uffdio_copy uffdio_copy;
+              uffdio_copy.src = (unsigned long) page;
+
+              // We need to handle page faults in units of pages(!).
+              // So, round faulting address down to page boundary
+              uffdio_copy.dst = (unsigned long) msg->arg.pagefault.address & ~(PAGE_SIZE - 1);
+              uffdio_copy.len = PAGE_SIZE;
+              uffdio_copy.mode = 0;
+              uffdio_copy.copy = 0;
+              if (ioctl(uffd, UFFDIO_COPY, &uffdio_copy) == -1) {
+                  printf("UFFDIO_COPY failed\n");
+                  exit(EXIT_FAILURE);
+              }
+
+              trace(TRACE_COPY, uffd, uffdio_copy.dst, 0, uffdio_copy.copy);
+          }
+
+          // A short read means the queue is empty. With one message per read,
+          // go back to poll() after every fault like the unbatched loop.
+          if (MSGS_PER_READ == 1 || nmsgs < MSGS_PER_READ)
+            break;
       }
 
-      printf("        (uffdio_copy.copy returned %"PRId64")\n",
-             uffdio_copy.copy);
+      // Unbatched handling costs one poll() and one read() per fault.
+      trace(TRACE_BATCH, uffd, syscalls, batch_faults, fault_cnt);
   }
 }
 
@@ -105,7 +136,7 @@ int main() {
   }
   printf("memfd: %d\n", memfd);
 
-  int r = ftruncate(memfd, SIZE);
+  int r = ftruncate(memfd, SIZE + PAGE_SIZE);
   if (r < 0) {
     printf("memfd failed\n");
     return 1;
@@ -118,6 +149,14 @@ int main() {
   }
   printf("memfd_map: %p\n", memfd_map);
 
+  // Rung once the first page has been faulted in.
+  struct doorbell* faulted = (struct doorbell*)mmap(0, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                                    memfd, SIZE);
+  if (faulted == MAP_FAILED) {
+    printf("doorbell map failed\n");
+    return 1;
+  }
+
   // create uffd
   int uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
   if (uffd < 0) {
@@ -145,6 +184,8 @@ int main() {
   }
   printf("uffd_register\n");
 
+  trace_start();
+
   // create uffd thread
   pthread_t thr; // ID of thread that handles page faults
   int s = pthread_create(&thr, NULL, fault_handler_thread, (void *) uffd);
@@ -202,6 +243,7 @@ int main() {
   printf("Reading address %p\n", memfd_map);
   char c = *memfd_map;
   printf("Byte: %c\n", c);
+  doorbell_ring(faulted);
 
   printf("Reading 10 bytes from memfd_map\n");
   printf("10 bytes of memfd_map: %.*s\n", 10, memfd_map);
@@ -211,6 +253,8 @@ int main() {
   int n = read(memfd, &read_buff, 10);
   printf("10 bytes of memfd: %.*s\n", 10, &read_buff);
 
+  trace_stop();
+  munmap(faulted, PAGE_SIZE);
   munmap(memfd_map, SIZE);
   close(memfd);
   close(sockfd);
@@ -8,7 +8,6 @@
 #include <pthread.h>
 #include <sys/un.h>
 #include <sys/mman.h>
-#include <sys/time.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -16,109 +15,66 @@
 #include <linux/memfd.h>
 #include <linux/userfaultfd.h>
 
-const int PAGE_SIZE = 4096;
-const int NUM_PAGES = 20;
-const int SIZE = PAGE_SIZE * NUM_PAGES;
+#include "../common/timing.h"
+#include "../common/uffd_setup.h"
+
+// Page size and region size follow the region front describes in its
+// setup message.
+static int PAGE_SIZE = 4096;
+static int NUM_PAGES = 20;
+static uint64_t SIZE;
 const char* SERVER_SOCKET_PATH = "test_socket";
 const char* UFFD_SOCKET_PATH = "test_socket_uffd";
 
-#define LOG_TIME(fn) \
-    struct timeval tv; \
-    gettimeofday(&tv,NULL); \
-    unsigned long before = 1000000 * tv.tv_sec + tv.tv_usec; \
-    fn; \
-    gettimeofday(&tv,NULL); \
-    unsigned long after = 1000000 * tv.tv_sec + tv.tv_usec; \
-    printf("diff: %ld us (%ld ms)\n", after - before, (after - before) / 1000); 
-
-int get_mmfd(int sockfd) {
-  printf("Waiting for memfd message\n");
-  char iov_dummy;
-  struct iovec iov = { 
-    .iov_base = &iov_dummy, 
-    .iov_len = sizeof(char) 
-  };
-  char buff[CMSG_SPACE(sizeof(int))];
-
-  struct msghdr msg = {
-    .msg_name = 0,
-    .msg_namelen = 0,
-    .msg_iov = &iov,
-    .msg_iovlen = 1,
-    .msg_control = &buff,
-    .msg_controllen = sizeof(buff),
-    .msg_flags = 0,
-  };
-
-  int n = recvmsg(sockfd, &msg, 0);
-  printf("Received: %d bytes\n", n);
-
-  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-  int memfd = *(int*)CMSG_DATA(cmsg);
-  printf("memfd: %d\n", memfd);
-
-  return memfd;
-}
-
-void send_uffd(int sockfd, uint64_t memfd_map, int uffd) {
-  struct iovec iov = {
-    .iov_base = &memfd_map,
-    .iov_len = sizeof(uint64_t),
-  };
-  char buff[CMSG_SPACE(sizeof(int))];
-  struct msghdr msg = {
-    .msg_name = 0,
-    .msg_namelen = 0,
-    .msg_iov = &iov,
-    .msg_iovlen = 1,
-    .msg_control = &buff,
-    .msg_controllen = sizeof(buff),
-    .msg_flags = 0,
-  };
-
-  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-  cmsg->cmsg_level = SOL_SOCKET;
-  cmsg->cmsg_type = SCM_RIGHTS;
-  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
-  int* data = (int*)CMSG_DATA(cmsg);
-  memcpy(data, &uffd, sizeof(int));
+int main(int argc, char** argv) {
+  int minor = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "m")) != -1) {
+    switch (opt) {
+      case 'm': minor = 1; break;
+      default:
+        printf("Usage: %s [-m]\n", argv[0]);
+        printf("  -m  register for minor faults too, the front and uffd server need -m\n");
+        exit(EXIT_FAILURE);
+    }
+  }
 
-  printf("sending uffd FD: %d\n", uffd);
-  printf("sending uffd addres: %p\n", memfd_map);
-  int r = sendmsg(sockfd, &msg, 0);
-  if (r < 0) {
-    perror("sending uffd fd");
+  // WAIT FOR FRONT
+  printf("Listening on %s\n", SERVER_SOCKET_PATH);
+  int listen_fd = uffd_setup_listen(SERVER_SOCKET_PATH, 1);
+  if (listen_fd < 0) {
+    perror("listen failed");
     exit(EXIT_FAILURE);
-  } 
-}
-
-int main() {
-  // CREATE SOCKET
-  printf("Creating socket\n");
-  int sockfd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  }
+  int sockfd = accept(listen_fd, NULL, NULL);
   if (sockfd < 0) {
-    perror("sockfd failed");
+    perror("accept failed");
     exit(EXIT_FAILURE);
   }
-  printf("socked fd: %d\n", sockfd);
-
+  close(listen_fd);
   unlink(SERVER_SOCKET_PATH);
 
-  struct sockaddr_un server_addr;
-  memset(&server_addr, 0, sizeof(server_addr));
-  server_addr.sun_family = AF_UNIX;
-  strncpy(server_addr.sun_path, SERVER_SOCKET_PATH, strlen(SERVER_SOCKET_PATH));
-
-  if (bind(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-    perror("bind failed");
+  // RECIEVE MEMFD
+  printf("Waiting for memfd message\n");
+  struct uffd_setup setup;
+  if (uffd_setup_recv(sockfd, &setup) < 0) {
+    uffd_setup_ack(sockfd, errno);
+    perror("bad setup from front");
     exit(EXIT_FAILURE);
   }
-  printf("socket bind done\n");
-
-  // RECIEVE MEMFD
-  int memfd = get_mmfd(sockfd);
-
-  char* memfd_map = (char*)mmap(0, SIZE, PROT_READ, MAP_SHARED, memfd, 0);
+  if (setup.hdr.memfd < 0 || setup.hdr.num_regions != 1) {
+    uffd_setup_ack(sockfd, EINVAL);
+    printf("front must send a memfd and one region\n");
+    exit(EXIT_FAILURE);
+  }
+  int memfd = setup.fds[setup.hdr.memfd];
+  PAGE_SIZE = setup.regions[0].page_size;
+  SIZE = setup.regions[0].len;
+  NUM_PAGES = SIZE / PAGE_SIZE;
+  uint64_t memfd_offset = setup.regions[0].memfd_offset;
+  printf("memfd: %d, region size: %"PRIu64", page size: %d\n", memfd, SIZE, PAGE_SIZE);
+
+  char* memfd_map = (char*)mmap(0, SIZE, PROT_READ, MAP_SHARED, memfd, memfd_offset);
   if (memfd_map == MAP_FAILED) {
     perror("memfd map failed");
     exit(EXIT_FAILURE);
@@ -137,6 +93,8 @@ int main() {
   struct uffdio_api uffdio_api;
   uffdio_api.api = UFFD_API;
   uffdio_api.features = 0;
+  if (minor)
+    uffdio_api.features = PAGE_SIZE != 4096 ? UFFD_FEATURE_MINOR_HUGETLBFS : UFFD_FEATURE_MINOR_SHMEM;
   if (ioctl(uffd, UFFDIO_API, &uffdio_api) == -1) {
     perror("uffd_api failed");
     exit(EXIT_FAILURE);
@@ -147,33 +105,47 @@ int main() {
   uffdio_register.range.start = (uint64_t)memfd_map;
   uffdio_register.range.len = SIZE;
   uffdio_register.mode = UFFDIO_REGISTER_MODE_MISSING;
+  if (minor)
+    uffdio_register.mode |= UFFDIO_REGISTER_MODE_MINOR;
   if (ioctl(uffd, UFFDIO_REGISTER, &uffdio_register) == -1) {
     perror("uffd_register failed");
     exit(EXIT_FAILURE);
   }
   printf("uffd_register done\n");
 
-  // CONNECT TO THE SOCKET
-  if (connect(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-    perror("connect failed");
+  // SEND UFFD BACK
+  // Our setup message is the answer to front's.
+  printf("Sending uffd back\n");
+  struct uffd_setup reply;
+  uffd_setup_init(&reply);
+  int uffd_index = uffd_setup_add_fd(&reply, uffd);
+  uffd_setup_add_region(&reply, (uint64_t)memfd_map, SIZE, memfd_offset, PAGE_SIZE, uffd_index);
+  if (uffd_setup_send(sockfd, &reply) < 0) {
+    perror("sending uffd failed");
     exit(EXIT_FAILURE);
   }
 
-  // SEND UFFD BACK
-  printf("Sending uffd back\n");
-  send_uffd(sockfd, (uint64_t)memfd_map, uffd);
-  
-  printf("sleeping for 0.2 second\n");
-  sleep(0.2);
+  // Our faults are served once front got the ack of the uffd server.
+  printf("waiting for front\n");
+  if (uffd_setup_wait_ack(sockfd) < 0) {
+    perror("front could not register with the uffd server");
+    exit(EXIT_FAILURE);
+  }
 
   // DO PAGE FAULT
+  // The first read of every page may fault, the second one never does.
+  struct histogram read_hist[2];
+  hist_init(&read_hist[0], "first read");
+  hist_init(&read_hist[1], "second read");
   for (int p = 0; p < NUM_PAGES; p++) {
     for (int i = 0; i < 2; i++) {
-      char* ptr = memfd_map + PAGE_SIZE * p;
-      LOG_TIME(char c = *(ptr))
+      volatile char* ptr = memfd_map + (uint64_t)PAGE_SIZE * p;
+      TIME_INTO(read_hist[i], char c = *(ptr))
       printf("Read page: %d, address %p, offset: %d, byte: %c\n", p, ptr, ptr - memfd_map, c);
     }
   }
+  hist_print(&read_hist[0]);
+  hist_print(&read_hist[1]);
 
   munmap(memfd_map, SIZE);
   close(sockfd);
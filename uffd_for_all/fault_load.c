@@ -0,0 +1,288 @@
+#define _GNU_SOURCE
+#include <time.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
+#include <linux/userfaultfd.h>
+
+#include "../common/uffd_setup.h"
+
+// Load generator for the uffd server: creates many uffd registered
+// memfd regions, hands them all to the server and faults every page
+// of every region from several threads at the same time.
+
+// 2 MiB with -H, for hugetlb backed regions.
+static int PAGE_SIZE = 4096;
+static int memfd_flags = 0;
+const char* UFFD_SOCKET_PATH = "test_socket_uffd";
+
+#define MAX_REGIONS 64
+#define MAX_THREADS 16
+
+struct region {
+  char* map;
+  uint64_t size;
+  int uffd;
+};
+
+// Every thread touches its own slice of one region.
+struct toucher {
+  char* start;
+  uint64_t size;
+  pthread_t thread;
+};
+
+static int num_regions = 8;
+static int num_pages = 4096;
+static int threads_per_region = 1;
+// Snapshot the server restores from, to check the served contents.
+static const char* verify_path = NULL;
+// Negotiate the non-cooperative events and change the address space
+// while being served.
+static int events = 0;
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+void create_region(struct region* r) {
+  r->size = (uint64_t)num_pages * PAGE_SIZE;
+
+  int memfd = syscall(SYS_memfd_create, "memfd_load", memfd_flags);
+  if (memfd < 0) {
+    perror("memfd failed");
+    exit(EXIT_FAILURE);
+  }
+  if (ftruncate(memfd, r->size) < 0) {
+    perror("ftruncate failed");
+    exit(EXIT_FAILURE);
+  }
+
+  r->map = (char*)mmap(0, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (r->map == MAP_FAILED) {
+    perror("memfd map failed");
+    exit(EXIT_FAILURE);
+  }
+  close(memfd);
+
+  r->uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+  if (r->uffd < 0) {
+    perror("uffd creation failed");
+    exit(EXIT_FAILURE);
+  }
+
+  struct uffdio_api uffdio_api;
+  uffdio_api.api = UFFD_API;
+  uffdio_api.features = 0;
+  if (events)
+    uffdio_api.features = UFFD_FEATURE_EVENT_REMOVE | UFFD_FEATURE_EVENT_UNMAP |
+                          UFFD_FEATURE_EVENT_REMAP | UFFD_FEATURE_EVENT_FORK;
+  if (ioctl(r->uffd, UFFDIO_API, &uffdio_api) == -1) {
+    perror("uffd_api failed");
+    exit(EXIT_FAILURE);
+  }
+
+  struct uffdio_register uffdio_register;
+  uffdio_register.range.start = (unsigned long) r->map;
+  uffdio_register.range.len = r->size;
+  uffdio_register.mode = UFFDIO_REGISTER_MODE_MISSING;
+  if (ioctl(r->uffd, UFFDIO_REGISTER, &uffdio_register) == -1) {
+    perror("uffd_register failed");
+    exit(EXIT_FAILURE);
+  }
+}
+
+void* touch_region(void* arg) {
+  struct toucher* t = (struct toucher*)arg;
+  volatile char sum = 0;
+  for (uint64_t off = 0; off < t->size; off += PAGE_SIZE)
+    sum += t->start[off];
+  return NULL;
+}
+
+// Give the second half of every region back with MADV_REMOVE and
+// touch it again, so the server serves it a second time. Then fork a
+// child that reads every region and move the first region elsewhere.
+void change_address_space(struct region* regions) {
+  uint64_t before = now_ns();
+  uint64_t removed = 0;
+  for (int i = 0; i < num_regions; i++) {
+    uint64_t half = regions[i].size / 2 / PAGE_SIZE * PAGE_SIZE;
+    if (madvise(regions[i].map + half, regions[i].size - half, MADV_REMOVE) < 0) {
+      perror("madvise failed");
+      exit(EXIT_FAILURE);
+    }
+    removed += (regions[i].size - half) / PAGE_SIZE;
+  }
+  uint64_t removed_ns = now_ns() - before;
+
+  before = now_ns();
+  for (int i = 0; i < num_regions; i++) {
+    struct toucher t = {
+      .start = regions[i].map + regions[i].size / 2 / PAGE_SIZE * PAGE_SIZE,
+      .size = regions[i].size - regions[i].size / 2 / PAGE_SIZE * PAGE_SIZE,
+    };
+    touch_region(&t);
+  }
+  printf("removed %"PRIu64" pages in %"PRIu64" us, faulted them in again in %"PRIu64" us\n",
+         removed, removed_ns / 1000, (now_ns() - before) / 1000);
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork failed");
+    exit(EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    for (int i = 0; i < num_regions; i++) {
+      struct toucher t = { .start = regions[i].map, .size = regions[i].size };
+      touch_region(&t);
+    }
+    _exit(0);
+  }
+  waitpid(pid, NULL, 0);
+  printf("forked child read every region\n");
+
+  // Reserve a new range and move the region over it.
+  char* to = (char*)mmap(0, regions[0].size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  char* moved = to == MAP_FAILED ? MAP_FAILED :
+      (char*)mremap(regions[0].map, regions[0].size, regions[0].size,
+                    MREMAP_MAYMOVE | MREMAP_FIXED, to);
+  if (moved == MAP_FAILED) {
+    perror("mremap failed");
+    exit(EXIT_FAILURE);
+  }
+  printf("moved region 0 from %p to %p\n", regions[0].map, moved);
+  regions[0].map = moved;
+}
+
+// Compare every region against the start of the snapshot file.
+int verify_regions(struct region* regions) {
+  int fd = open(verify_path, O_RDONLY);
+  if (fd < 0) {
+    perror("open snapshot failed");
+    exit(EXIT_FAILURE);
+  }
+  uint64_t size = regions[0].size;
+  char* snapshot = (char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (snapshot == MAP_FAILED) {
+    perror("snapshot map failed");
+    exit(EXIT_FAILURE);
+  }
+
+  int bad = 0;
+  for (int i = 0; i < num_regions; i++) {
+    for (uint64_t off = 0; off < size; off += PAGE_SIZE) {
+      if (memcmp(regions[i].map + off, snapshot + off, PAGE_SIZE)) {
+        printf("region %d: page %"PRIu64" differs from the snapshot\n", i, off / PAGE_SIZE);
+        bad++;
+        break;
+      }
+    }
+  }
+  munmap(snapshot, size);
+  close(fd);
+  printf("verify: %d of %d regions match the snapshot\n", num_regions - bad, num_regions);
+  return bad;
+}
+
+int main(int argc, char** argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "n:p:t:v:He")) != -1) {
+    switch (opt) {
+      case 'n': num_regions = atoi(optarg); break;
+      case 'p': num_pages = atoi(optarg); break;
+      case 't': threads_per_region = atoi(optarg); break;
+      case 'v': verify_path = optarg; break;
+      case 'e': events = 1; break;
+      case 'H':
+        PAGE_SIZE = 2 * 1024 * 1024;
+        memfd_flags = MFD_HUGETLB | MFD_HUGE_2MB;
+        break;
+      default:
+        printf("Usage: %s [-n regions] [-p pages per region] [-t threads per region]"
+               " [-v snapshot] [-H] [-e]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+  if (num_regions < 1 || num_regions > MAX_REGIONS ||
+      threads_per_region < 1 || threads_per_region > MAX_THREADS ||
+      num_pages < threads_per_region) {
+    printf("invalid arguments\n");
+    exit(EXIT_FAILURE);
+  }
+
+  struct region regions[MAX_REGIONS];
+  for (int i = 0; i < num_regions; i++)
+    create_region(&regions[i]);
+
+  // All regions in one setup message, faulting starts with the ack.
+  int uffd_sockfd = uffd_setup_connect(UFFD_SOCKET_PATH);
+  if (uffd_sockfd < 0) {
+    perror("connect failed");
+    exit(EXIT_FAILURE);
+  }
+  struct uffd_setup setup;
+  uffd_setup_init(&setup);
+  for (int i = 0; i < num_regions; i++) {
+    int index = uffd_setup_add_fd(&setup, regions[i].uffd);
+    uffd_setup_add_region(&setup, (uint64_t)regions[i].map, regions[i].size, 0, PAGE_SIZE, index);
+  }
+  uint64_t setup_ns = now_ns();
+  if (uffd_setup_send(uffd_sockfd, &setup) < 0 || uffd_setup_wait_ack(uffd_sockfd) < 0) {
+    perror("uffd server setup failed");
+    exit(EXIT_FAILURE);
+  }
+  printf("Sent %d regions of %d pages, acked in %"PRIu64" us\n", num_regions, num_pages,
+         (now_ns() - setup_ns) / 1000);
+
+  static struct toucher touchers[MAX_REGIONS * MAX_THREADS];
+  int num_touchers = num_regions * threads_per_region;
+  uint64_t slice = (uint64_t)(num_pages / threads_per_region) * PAGE_SIZE;
+  for (int i = 0; i < num_touchers; i++) {
+    struct region* r = &regions[i / threads_per_region];
+    int t = i % threads_per_region;
+    touchers[i].start = r->map + t * slice;
+    touchers[i].size = t == threads_per_region - 1 ? r->size - t * slice : slice;
+  }
+
+  uint64_t before = now_ns();
+  for (int i = 0; i < num_touchers; i++) {
+    if (pthread_create(&touchers[i].thread, NULL, touch_region, &touchers[i]) != 0) {
+      printf("thread creation failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (int i = 0; i < num_touchers; i++)
+    pthread_join(touchers[i].thread, NULL);
+  uint64_t elapsed = now_ns() - before;
+
+  uint64_t faults = (uint64_t)num_regions * num_pages;
+  printf("faulted %"PRIu64" pages in %"PRIu64" us, %.0f faults/s\n",
+         faults, elapsed / 1000, faults * 1e9 / elapsed);
+
+  if (events)
+    change_address_space(regions);
+
+  int bad = verify_path ? verify_regions(regions) : 0;
+
+  for (int i = 0; i < num_regions; i++) {
+    munmap(regions[i].map, regions[i].size);
+    close(regions[i].uffd);
+  }
+  close(uffd_sockfd);
+  return bad ? EXIT_FAILURE : 0;
+}
@@ -8,7 +8,6 @@
 #include <pthread.h>
 #include <sys/un.h>
 #include <sys/mman.h>
-#include <sys/time.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -16,141 +15,51 @@
 #include <linux/memfd.h>
 #include <linux/userfaultfd.h>
 
-const int PAGE_SIZE = 4096;
-const int NUM_PAGES = 20;
-const int SIZE = PAGE_SIZE * NUM_PAGES;
+#include "../common/timing.h"
+#include "../common/uffd_setup.h"
+
+const int BASE_PAGE_SIZE = 4096;
+const int HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+// Set from the command line: 4 KiB pages by default, 2 MiB
+// hugetlb pages with -H. SIZE is NUM_PAGES of them.
+static int PAGE_SIZE = BASE_PAGE_SIZE;
+static int NUM_PAGES = 20;
+static uint64_t SIZE;
 const char* SERVER_SOCKET_PATH = "test_socket";
 const char* UFFD_SOCKET_PATH = "test_socket_uffd";
-
-#define LOG_TIME(fn) \
-    struct timeval tv; \
-    gettimeofday(&tv,NULL); \
-    unsigned long before = 1000000 * tv.tv_sec + tv.tv_usec; \
-    fn; \
-    gettimeofday(&tv,NULL); \
-    unsigned long after = 1000000 * tv.tv_sec + tv.tv_usec; \
-    printf("diff: %ld us (%ld ms)\n", after - before, (after - before) / 1000); 
-
-int connect_socket(int sockfd, const char* path) {
-  struct sockaddr_un server_addr;
-  memset(&server_addr, 0, sizeof(server_addr));
-  server_addr.sun_family = AF_UNIX;
-  strncpy(server_addr.sun_path, path, strlen(path));
-
-  if (connect(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-    perror("connect failed");
-    exit(EXIT_FAILURE);
-  }
-
-  return sockfd;
-}
-
-void bind_socket(int sockfd, const char* path) {
-  struct sockaddr_un server_addr;
-  memset(&server_addr, 0, sizeof(server_addr));
-  server_addr.sun_family = AF_UNIX;
-  strncpy(server_addr.sun_path, path, strlen(path));
-
-  if (bind(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-    perror("bind failed");
-    exit(EXIT_FAILURE);
+// Reads slower than this waited for the uffd server to serve a fault.
+const int FAULT_US = 5;
+
+int main(int argc, char** argv) {
+  int memfd_flags = 0;
+  int minor = 0;
+  // Write to every dirty_stride-th page after the reads, 0: no writes.
+  int dirty_stride = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "Hmd:n:")) != -1) {
+    switch (opt) {
+      case 'H':
+        PAGE_SIZE = HUGE_PAGE_SIZE;
+        memfd_flags = MFD_HUGETLB | MFD_HUGE_2MB;
+        break;
+      case 'm': minor = 1; break;
+      case 'd': dirty_stride = atoi(optarg); break;
+      case 'n': NUM_PAGES = atoi(optarg); break;
+      default:
+        printf("Usage: %s [-H] [-m] [-d stride] [-n pages]\n", argv[0]);
+        printf("  -H  back the memfd with 2 MiB hugetlb pages\n");
+        printf("  -m  register for minor faults too and send the memfd to the uffd server\n");
+        printf("  -d  register for write-protect faults, send the memfd to the uffd server\n"
+               "      and write to every stride-th page after reading the region\n");
+        printf("  -n  region size in pages (default %d)\n", NUM_PAGES);
+        exit(EXIT_FAILURE);
+    }
   }
-} 
-
-void send_fd(int sockfd, int fd) {
-  char iov_dummy = 'A';
-  struct iovec iov = {
-    .iov_base = &iov_dummy,
-    .iov_len = sizeof(char),
-  };
-  char buff[CMSG_SPACE(sizeof(int))];
-  struct msghdr msg = {
-    .msg_name = 0,
-    .msg_namelen = 0,
-    .msg_iov = &iov,
-    .msg_iovlen = 1,
-    .msg_control = &buff,
-    .msg_controllen = sizeof(buff),
-    .msg_flags = 0,
-  };
-
-  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-  cmsg->cmsg_level = SOL_SOCKET;
-  cmsg->cmsg_type = SCM_RIGHTS;
-  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
-  int* data = (int*)CMSG_DATA(cmsg);
-  memcpy(data, &fd, sizeof(int));
-
-  printf("sending FD: %d\n", fd);
-  int r = sendmsg(sockfd, &msg, 0);
-  if (r < 0) {
-    perror("sending uffd fd");
-    exit(EXIT_FAILURE);
-  } 
-}
-
-void send_fd_and_addr(int sockfd, int fd, uint64_t addr) {
-  struct iovec iov = {
-    .iov_base = &addr,
-    .iov_len = sizeof(uint64_t),
-  };
-  char buff[CMSG_SPACE(sizeof(int))];
-  struct msghdr msg = {
-    .msg_name = 0,
-    .msg_namelen = 0,
-    .msg_iov = &iov,
-    .msg_iovlen = 1,
-    .msg_control = &buff,
-    .msg_controllen = sizeof(buff),
-    .msg_flags = 0,
-  };
-
-  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-  cmsg->cmsg_level = SOL_SOCKET;
-  cmsg->cmsg_type = SCM_RIGHTS;
-  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
-  int* data = (int*)CMSG_DATA(cmsg);
-  memcpy(data, &fd, sizeof(int));
-
-  printf("sending FD: %d\n", fd);
-  int r = sendmsg(sockfd, &msg, 0);
-  if (r < 0) {
-    perror("sending uffd fd");
-    exit(EXIT_FAILURE);
-  } 
-}
-
-int get_uffd_from_backend(int sockfd, uint64_t* addr) {
-  struct iovec iov = { 
-    .iov_base = addr, 
-    .iov_len = sizeof(uint64_t) 
-  };
-  char buff[CMSG_SPACE(sizeof(int))];
+  SIZE = (uint64_t)PAGE_SIZE * NUM_PAGES;
 
-  struct msghdr msg = {
-    .msg_name = 0,
-    .msg_namelen = 0,
-    .msg_iov = &iov,
-    .msg_iovlen = 1,
-    .msg_control = &buff,
-    .msg_controllen = sizeof(buff),
-    .msg_flags = 0,
-  };
-
-  int n = recvmsg(sockfd, &msg, 0);
-  printf("received: %d bytes\n", n);
-
-  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-  int back_uffd = *(int*)CMSG_DATA(cmsg);
-  printf("back_uffd: %d", back_uffd);
-
-  return back_uffd;
-}
-
-int main() {
   // CREATE LOCAL MEMFD
-  printf("Creating memfd\n");
-  int memfd = syscall(SYS_memfd_create, "memfd_test", 0);
+  printf("Creating memfd, page size %d\n", PAGE_SIZE);
+  int memfd = syscall(SYS_memfd_create, "memfd_test", memfd_flags);
   if (memfd < 0) {
     perror("memfd failed\n");
     exit(EXIT_FAILURE);
@@ -170,33 +79,35 @@ int main() {
   }
   printf("memfd_map: %p\n", memfd_map);
 
-  // CREATE SOCKET
-  int back_sockfd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  // SEND MEMFD TO BACKEND
+  // One setup message with the memfd and our region, back answers on
+  // the same connection with its uffd and region.
+  printf("Connecting backend socket %s\n", SERVER_SOCKET_PATH);
+  int back_sockfd = uffd_setup_connect(SERVER_SOCKET_PATH);
   if (back_sockfd < 0) {
-    perror("back_sockfd failed");
+    perror("connect failed");
     exit(EXIT_FAILURE);
   }
-  printf("back_sockfd: %d", back_sockfd);
-
-  // CONNECT SOCKET TO BACKEND
-  printf("Connecting backend socket %s\n", SERVER_SOCKET_PATH);
-  connect_socket(back_sockfd, SERVER_SOCKET_PATH);
-
-  // SEND MEMFD TO BACKEND
+  struct uffd_setup setup;
+  uffd_setup_init(&setup);
+  setup.hdr.memfd = uffd_setup_add_fd(&setup, memfd);
+  uffd_setup_add_region(&setup, (uint64_t)memfd_map, SIZE, 0, PAGE_SIZE, -1);
   printf("Sending memfd\n");
-  send_fd(back_sockfd, memfd);
-
-  // UNLINK SOCKET
-  unlink(SERVER_SOCKET_PATH);
-
-  // BIND SOCKET
-  printf("Bingin backend socket: %s\n", SERVER_SOCKET_PATH);
-  bind_socket(back_sockfd, SERVER_SOCKET_PATH);
+  if (uffd_setup_send(back_sockfd, &setup) < 0) {
+    perror("sending memfd failed");
+    exit(EXIT_FAILURE);
+  }
 
   // RECIEVE UFFD FROM BACKEND
   printf("Waiting for uffd message\n");
-  uint64_t back_uffd_addr;
-  int back_uffd = get_uffd_from_backend(back_sockfd, &back_uffd_addr);
+  struct uffd_setup back_setup;
+  if (uffd_setup_recv(back_sockfd, &back_setup) < 0 || back_setup.hdr.num_regions != 1 ||
+      back_setup.regions[0].uffd < 0) {
+    perror("bad setup from backend");
+    exit(EXIT_FAILURE);
+  }
+  int back_uffd = back_setup.fds[back_setup.regions[0].uffd];
+  uint64_t back_uffd_addr = back_setup.regions[0].start;
   printf("back_uffd: %d\n", back_uffd);
   printf("back_uffd_addr: %p\n", back_uffd_addr);
 
@@ -212,6 +123,13 @@ int main() {
   struct uffdio_api uffdio_api;
   uffdio_api.api = UFFD_API;
   uffdio_api.features = 0;
+  // Minor faults report pages that are in the page cache but not
+  // mapped here yet, the server resolves them with UFFDIO_CONTINUE.
+  if (minor)
+    uffdio_api.features = memfd_flags ? UFFD_FEATURE_MINOR_HUGETLBFS : UFFD_FEATURE_MINOR_SHMEM;
+  // Write-protect faults let the server track which pages we dirty.
+  if (dirty_stride)
+    uffdio_api.features |= UFFD_FEATURE_WP_HUGETLBFS_SHMEM;
   if (ioctl(local_uffd, UFFDIO_API, &uffdio_api) == -1) {
     perror("uffd_api failed");
     exit(EXIT_FAILURE);
@@ -222,38 +140,89 @@ int main() {
   uffdio_register.range.start = (unsigned long) memfd_map;
   uffdio_register.range.len = SIZE;
   uffdio_register.mode = UFFDIO_REGISTER_MODE_MISSING;
+  // MINOR alone would let a fault on a hole allocate a zero page
+  // without asking the server, so keep MISSING registered as well.
+  if (minor)
+    uffdio_register.mode |= UFFDIO_REGISTER_MODE_MINOR;
+  if (dirty_stride)
+    uffdio_register.mode |= UFFDIO_REGISTER_MODE_WP;
   if (ioctl(local_uffd, UFFDIO_REGISTER, &uffdio_register) == -1) {
     printf("uffd_register failed\n");
     exit(EXIT_FAILURE);
   }
   printf("uffd_register done\n");
 
-  // CREATE UFFD SOCKET
-  int uffd_sockfd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  // SEND ALL UFFDS AND THE MEMFD TO THE UFFD SERVER
+  // One message for both regions, the server acks once it serves them.
+  printf("Connecting uffd socket: %s\n", UFFD_SOCKET_PATH);
+  int uffd_sockfd = uffd_setup_connect(UFFD_SOCKET_PATH);
   if (uffd_sockfd < 0) {
-    perror("uffd_sockfd failed\n");
+    perror("uffd connect failed");
     exit(EXIT_FAILURE);
   }
+  uffd_setup_init(&setup);
+  int local_index = uffd_setup_add_fd(&setup, local_uffd);
+  int back_index = uffd_setup_add_fd(&setup, back_uffd);
+  if (minor || dirty_stride)
+    setup.hdr.memfd = uffd_setup_add_fd(&setup, memfd);
+  uffd_setup_add_region(&setup, (uint64_t)memfd_map, SIZE, 0, PAGE_SIZE, local_index);
+  uffd_setup_add_region(&setup, back_uffd_addr, back_setup.regions[0].len,
+                        back_setup.regions[0].memfd_offset, back_setup.regions[0].page_size,
+                        back_index);
+  printf("Sending local_uffd and back_uffd\n");
+  uint64_t before = timing_now();
+  if (uffd_setup_send(uffd_sockfd, &setup) < 0 || uffd_setup_wait_ack(uffd_sockfd) < 0) {
+    perror("uffd server setup failed");
+    exit(EXIT_FAILURE);
+  }
+  printf("uffd server took over the regions in %"PRIu64" us\n", (timing_now() - before) / 1000);
 
-  // CONNECT UFFD SOCKET TO UFFD
-  printf("Connecting uffd socket: %s\n", UFFD_SOCKET_PATH);
-  connect_socket(uffd_sockfd, UFFD_SOCKET_PATH);
-
-  // SEND LOCAL UFFD
-  printf("Sending local_uffd\n");
-  send_fd_and_addr(uffd_sockfd, local_uffd, (uint64_t)memfd_map);
-  send_fd_and_addr(uffd_sockfd, back_uffd, back_uffd_addr);
-
-  printf("Sleeping for 0.1 second");
-  sleep(0.1);
+  // Back faults from here on.
+  uffd_setup_ack(back_sockfd, 0);
 
   // DO PAGE FAULT
+  // Every 4 KiB of the region is read whatever the page size, so
+  // runs with 4 KiB and 2 MiB pages touch the same bytes.
+  // The first read of every 4 KiB may fault, the second one never does.
+  struct histogram read_hist[2];
+  hist_init(&read_hist[0], "first read");
+  hist_init(&read_hist[1], "second read");
+  int faulted = 0;
+  int reads = 0;
+  uint64_t read_ns = 0;
   for (int p = 0; p < NUM_PAGES; p++) {
-    for (int i = 0; i < 2; i++) {
-      char* ptr = memfd_map + PAGE_SIZE * p;
-      LOG_TIME(char c = *(ptr))
-      printf("Read page: %d, address %p, offset: %d, byte: %c\n", p, ptr, ptr - memfd_map, c);
+    for (int b = 0; b < PAGE_SIZE; b += BASE_PAGE_SIZE) {
+      for (int i = 0; i < 2; i++) {
+        volatile char* ptr = memfd_map + (uint64_t)PAGE_SIZE * p + b;
+        TIME_INTO(read_hist[i], char c = *(ptr))
+        if (elapsed_ns > FAULT_US * 1000)
+          faulted++;
+        read_ns += elapsed_ns;
+        reads++;
+        if (b == 0)
+          printf("Read page: %d, address %p, offset: %d, byte: %c\n", p, ptr, ptr - memfd_map, c);
+      }
+    }
+  }
+  printf("%d of %d reads waited for the uffd server (> %d us)\n",
+         faulted, reads, FAULT_US);
+  printf("reading %"PRIu64" KiB with %d KiB pages took %"PRIu64" us\n",
+         SIZE / 1024, PAGE_SIZE / 1024, read_ns / 1000);
+  hist_print(&read_hist[0]);
+  hist_print(&read_hist[1]);
+
+  // Dirty some pages. The first write to each one waits for the
+  // server to record it.
+  if (dirty_stride) {
+    struct histogram write_hist;
+    hist_init(&write_hist, "first write");
+    for (int p = 0; p < NUM_PAGES; p += dirty_stride) {
+      volatile char* ptr = memfd_map + (uint64_t)PAGE_SIZE * p;
+      TIME_INTO(write_hist, *ptr = 'a' + p % 26)
     }
+    printf("dirtied %"PRIu64" of %d pages in %"PRIu64" us\n",
+           write_hist.count, NUM_PAGES, write_hist.sum / 1000);
+    hist_print(&write_hist);
   }
 
   munmap(memfd_map, SIZE);
@@ -1,13 +1,20 @@
 #define _GNU_SOURCE
 #include <poll.h>
+#include <time.h>
+#include <sched.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <inttypes.h>
 #include <pthread.h>
 #include <sys/un.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -15,163 +22,1371 @@
 #include <linux/memfd.h>
 #include <linux/userfaultfd.h>
 
-const int PAGE_SIZE = 4096;
+#include "../common/loader.h"
+#include "../common/uffd_setup.h"
+#include "../common/zero_page.h"
+
+const int BASE_PAGE_SIZE = 4096;
+const int HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+// Fault granularity: 4 KiB pages by default, 2 MiB pages with -H
+// for hugetlb memfds. Region sizes are counted in these pages.
+static int PAGE_SIZE = BASE_PAGE_SIZE;
 const int NUM_PAGES = 20;
-const int SIZE = PAGE_SIZE * NUM_PAGES;
-const char* SERVER_SOCKET_PATH = "test_socket";
 const char* UFFD_SOCKET_PATH = "test_socket_uffd";
 
-int get_fd_and_addr(int sockfd, uint64_t* addr) {
-  struct iovec iov = { 
-    .iov_base = addr, 
-    .iov_len = sizeof(uint64_t) 
-  };
-  char buff[CMSG_SPACE(sizeof(int))];
-
-  struct msghdr msg = {
-    .msg_name = 0,
-    .msg_namelen = 0,
-    .msg_iov = &iov,
-    .msg_iovlen = 1,
-    .msg_control = &buff,
-    .msg_controllen = sizeof(buff),
-    .msg_flags = 0,
+#define MAX_REGIONS 64
+#define MAX_WORKERS 64
+#define MAX_MSGS_PER_READ 64
+#define MAX_PREFETCH 512
+
+struct region {
+  int uffd;
+  uint64_t addr;
+  uint64_t len;
+  // One bit per page already copied into the region.
+  uint64_t* populated;
+  // One bit per page the client unmapped or moved away: there is
+  // nothing left to copy into, so it is never served again.
+  uint64_t* unmapped;
+  // Registered for write-protect faults: pages are copied in
+  // write protected so the first write to each one is seen.
+  int wp;
+  // The client unmapped the region or exited.
+  int gone;
+};
+
+// Non-cooperative events the clients negotiated. The server cannot
+// call UFFDIO_API on a uffd it received, so whoever creates the uffd
+// asks for UFFD_FEATURE_EVENT_{REMOVE,UNMAP,REMAP,FORK} and we keep
+// up with whatever arrives.
+struct event_stats {
+  uint64_t remove;
+  uint64_t removed_pages;
+  uint64_t unmap;
+  uint64_t remap;
+  uint64_t fork;
+};
+
+struct worker {
+  int id;
+  int epoll_fd;
+  pthread_t thread;
+  // Every worker stages pages in its own buffer, so workers
+  // never overwrite each other's contents mid copy. It holds
+  // a whole prefetch window.
+  char* page;
+  uint64_t faults;
+  uint64_t pages;
+  uint64_t syscalls;
+  uint64_t copy_ns;
+  uint64_t last_fault_ns;
+};
+
+static struct region regions[MAX_REGIONS];
+// Forked children add regions while the workers run.
+static pthread_mutex_t regions_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct event_stats events;
+static int num_regions = 2;
+static int num_workers = 4;
+static int msgs_per_read = 16;
+static int region_pages = NUM_PAGES;
+// Max number of pages resolved by a single fault.
+static int prefetch = 1;
+static int quiet = 0;
+
+// Backing store mapping. When set, faults are served straight from
+// the snapshot file at the faulting offset instead of a memset page.
+static const char* snapshot_path = NULL;
+static char* snapshot = NULL;
+static uint64_t snapshot_size = 0;
+// With -E the whole snapshot is read into a memfd by this many
+// threads before any region is served, so faults never wait on the
+// disk. LOAD_CHUNK bytes per pread.
+#define LOAD_CHUNK (4 * 1024 * 1024)
+static int eager_threads = 0;
+// One bit per all-zero snapshot page, computed once at startup. Those
+// pages are resolved with UFFDIO_ZEROPAGE instead of a copy.
+static const char* zero_scanner_name = NULL;
+static uint64_t* zero_pages = NULL;
+static uint64_t zero_served = 0;
+
+// Fault log. In record mode every demand fault is appended as
+// (region index, page index) and written out on exit. In replay
+// mode a recorded log is copied in, in order, ahead of the client.
+#define RECORD_MAGIC 0x4c524655  // "UFRL"
+#define RECORD_PAGE_BITS 26
+#define RECORD_PAGE_MASK ((1u << RECORD_PAGE_BITS) - 1)
+
+struct record_header {
+  uint32_t magic;
+  uint32_t page_size;
+  uint64_t count;
+};
+
+static const char* record_path = NULL;
+static const char* replay_path = NULL;
+// Region index in the top bits, page index in the low RECORD_PAGE_BITS.
+static uint32_t* records = NULL;
+static uint64_t records_len = 0;
+static uint64_t records_cap = 0;
+
+// Minor fault mode (-m). Front and back register their mappings with
+// MISSING|MINOR and the front also sends its memfd. Every page is
+// written into the memfd page cache once, through our own mapping of
+// it, and each region then only needs its PTE installed with
+// UFFDIO_CONTINUE.
+static int minor = 0;
+static int memfd = -1;
+static char* memfd_map = NULL;
+static uint64_t memfd_size = 0;
+// One bit per memfd page: claimed by a filler, and in the page cache.
+static uint64_t* claimed = NULL;
+static uint64_t* filled = NULL;
+static uint64_t minor_faults = 0;
+
+// Dirty tracking (-d). The front registers its region, always the
+// first one, with MISSING|WP. The first write to every page after a
+// checkpoint raises a write-protect fault, which marks the page dirty
+// and lifts the protection. A checkpoint re-protects the whole region
+// with one UFFDIO_WRITEPROTECT and writes only the dirty pages, read
+// through the memfd, to the next incremental snapshot file.
+#define DIRTY_MAGIC 0x53444655  // "UFDS"
+
+struct dirty_header {
+  uint32_t magic;
+  uint32_t page_size;
+  uint64_t count;
+};
+
+static const char* dirty_path = NULL;
+static uint64_t* dirty = NULL;
+static uint64_t wp_faults = 0;
+static int checkpoints = 0;
+// Held shared while a write-protect fault is resolved, exclusively
+// while a checkpoint collects the dirty pages and re-protects.
+static pthread_rwlock_t dirty_lock = PTHREAD_RWLOCK_INITIALIZER;
+static volatile sig_atomic_t checkpoint_requested = 0;
+
+// Background fill (-F). A low priority thread streams every page not
+// yet populated into the regions, at most fill_rate MiB/s (0: no cap),
+// in chunks of FILL_CHUNK_BYTES. It backs off as long as any worker
+// is serving a demand fault.
+#define FILL_CHUNK_BYTES (256 * 1024)
+
+static int fill_rate = -1;
+static int demand_busy = 0;
+static uint64_t fill_pages = 0;
+static uint64_t fill_preempted = 0;
+
+static volatile sig_atomic_t stop = 0;
+static uint64_t fault_cnt = 0;
+static uint64_t first_fault_ns = 0;
+
+void on_sigint(int signo) {
+  stop = 1;
+}
+
+void on_sigusr1(int signo) {
+  checkpoint_requested = 1;
+}
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+char* create_page_buffer(int npages) {
+  char* page = (char*)mmap(NULL, (uint64_t)npages * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (page == MAP_FAILED) {
+    perror("uffd thread mmap failed");
+    exit(EXIT_FAILURE);
+  }
+  return page;
+}
+
+char* create_page() {
+  return create_page_buffer(prefetch);
+}
+
+void load_snapshot(const char* path) {
+  int memfd;
+  uint64_t before = now_ns();
+  snapshot = load_file(path, eager_threads, LOAD_CHUNK, &memfd, &snapshot_size);
+  if (!snapshot) {
+    perror("loading snapshot failed");
+    exit(EXIT_FAILURE);
+  }
+  uint64_t elapsed = now_ns() - before;
+  printf("snapshot: %s, %"PRIu64" bytes loaded in %"PRIu64" ms by %d threads, %.2f GB/s\n", path,
+         snapshot_size, elapsed / 1000000, eager_threads, snapshot_size / (double)elapsed);
+}
+
+void map_snapshot(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror("open snapshot failed");
+    exit(EXIT_FAILURE);
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    perror("fstat snapshot failed");
+    exit(EXIT_FAILURE);
+  }
+  snapshot_size = st.st_size;
+
+  snapshot = (char*)mmap(NULL, snapshot_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (snapshot == MAP_FAILED) {
+    perror("snapshot map failed");
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+  printf("snapshot: %s, %"PRIu64" bytes\n", path, snapshot_size);
+}
+
+void scan_snapshot() {
+  // hugetlbfs has no UFFDIO_ZEROPAGE, zero huge pages are copied.
+  if (PAGE_SIZE != BASE_PAGE_SIZE ||
+      (zero_scanner_name && !strcmp(zero_scanner_name, "none")))
+    return;
+  ZeroScanner* scanner = zero_scanner(zero_scanner_name);
+  uint64_t zero_count;
+  uint64_t before = now_ns();
+  zero_pages = zero_page_bitmap(scanner, snapshot, snapshot_size, PAGE_SIZE, &zero_count);
+  printf("zero pages: %"PRIu64" of %"PRIu64", scanned in %"PRIu64" us with %s\n",
+         zero_count, snapshot_size / PAGE_SIZE, (now_ns() - before) / 1000, scanner->name);
+}
+
+// Whether page `page` needs no copy: populated already, or unmapped.
+int test_page(struct region* r, uint64_t page) {
+  uint64_t done = __atomic_load_n(&r->populated[page / 64], __ATOMIC_RELAXED) |
+                  __atomic_load_n(&r->unmapped[page / 64], __ATOMIC_RELAXED);
+  return (done >> (page % 64)) & 1;
+}
+
+void set_pages(struct region* r, uint64_t page, uint64_t count) {
+  for (uint64_t p = page; p < page + count; p++)
+    __atomic_fetch_or(&r->populated[p / 64], 1ul << (p % 64), __ATOMIC_RELAXED);
+}
+
+void wake_range(struct region* r, uint64_t start, uint64_t len) {
+  struct uffdio_range range = { .start = start, .len = len };
+  if (ioctl(r->uffd, UFFDIO_WAKE, &range) == -1) {
+    perror("UFFDIO_WAKE");
+    exit(EXIT_FAILURE);
+  }
+}
+
+enum fill_op { FILL_COPY, FILL_ZERO, FILL_CONTINUE };
+
+// Fill `npages` pages starting at page index `first` of region `r` with
+// as few ioctls as possible: UFFDIO_COPY from `src`, UFFDIO_ZEROPAGE, or
+// UFFDIO_CONTINUE for pages already in the page cache. The kernel stops
+// at the first page that is already present: everything before it is
+// filled and woken, the present page itself is skipped. A faulting
+// thread that waits on a skipped page still needs an explicit wake.
+// Returns the number of pages this call populated.
+uint64_t fill_range(struct region* r, uint64_t first, uint64_t npages, enum fill_op op, char* src) {
+  static const char* names[] = { "UFFDIO_COPY", "UFFDIO_ZEROPAGE", "UFFDIO_CONTINUE" };
+  uint64_t start = r->addr + first * PAGE_SIZE;
+  uint64_t len = npages * PAGE_SIZE;
+  uint64_t done = 0;
+  uint64_t skipped = 0;
+  while (done < len) {
+    int ret;
+    int64_t progress;
+    if (op == FILL_COPY) {
+      struct uffdio_copy uffdio_copy;
+      uffdio_copy.src = (unsigned long) src + done;
+      uffdio_copy.dst = start + done;
+      uffdio_copy.len = len - done;
+      uffdio_copy.mode = r->wp ? UFFDIO_COPY_MODE_WP : 0;
+      uffdio_copy.copy = 0;
+      ret = ioctl(r->uffd, UFFDIO_COPY, &uffdio_copy);
+      progress = uffdio_copy.copy;
+    } else if (op == FILL_ZERO) {
+      struct uffdio_zeropage uffdio_zeropage;
+      uffdio_zeropage.range.start = start + done;
+      uffdio_zeropage.range.len = len - done;
+      uffdio_zeropage.mode = 0;
+      uffdio_zeropage.zeropage = 0;
+      ret = ioctl(r->uffd, UFFDIO_ZEROPAGE, &uffdio_zeropage);
+      progress = uffdio_zeropage.zeropage;
+    } else {
+      struct uffdio_continue uffdio_continue;
+      uffdio_continue.range.start = start + done;
+      uffdio_continue.range.len = len - done;
+      uffdio_continue.mode = 0;
+      uffdio_continue.mapped = 0;
+      ret = ioctl(r->uffd, UFFDIO_CONTINUE, &uffdio_continue);
+      progress = uffdio_continue.mapped;
+    }
+    if (ret == 0) {
+      done = len;
+      break;
+    }
+
+    if (progress > 0) {
+      // Partial fill, retry from where the kernel stopped.
+      done += progress;
+    } else if (errno == EEXIST) {
+      // Populated behind our back (another mapping of the same memfd
+      // or another uffd). Skip it, but wake whoever waits on it.
+      wake_range(r, start + done, PAGE_SIZE);
+      done += PAGE_SIZE;
+      skipped++;
+    } else if (errno == ESRCH) {
+      // Nobody is left to see the pages, the background fill and
+      // the replay skip the region from now on.
+      r->gone = 1;
+      break;
+    } else if (errno == ENOENT) {
+      // The client unmapped the rest of the run under us, the UNMAP
+      // event marks it once it is read.
+      break;
+    } else if (errno != EAGAIN) {
+      perror(names[op]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  return done / PAGE_SIZE - skipped;
+}
+
+// Make sure pages [first, first + npages) of the memfd are in its page
+// cache, copied from `src` or allocated zeroed for zero snapshot pages.
+// The first worker to claim a page fills it and everybody else waits
+// for it, so no region ever maps a half written page.
+void fill_cache(uint64_t first, uint64_t npages, char* src) {
+  int from_snapshot = zero_pages && src == snapshot + first * PAGE_SIZE;
+  for (uint64_t i = 0; i < npages; i++) {
+    uint64_t p = first + i;
+    uint64_t bit = 1ul << (p % 64);
+    if (__atomic_load_n(&filled[p / 64], __ATOMIC_ACQUIRE) & bit)
+      continue;
+    if (__atomic_fetch_or(&claimed[p / 64], bit, __ATOMIC_RELAXED) & bit) {
+      while (!(__atomic_load_n(&filled[p / 64], __ATOMIC_ACQUIRE) & bit))
+        sched_yield();
+      continue;
+    }
+
+    if (from_snapshot && zero_page_test(zero_pages, p)) {
+      if (fallocate(memfd, 0, p * PAGE_SIZE, PAGE_SIZE) < 0) {
+        perror("fallocate failed");
+        exit(EXIT_FAILURE);
+      }
+      __atomic_fetch_add(&zero_served, 1, __ATOMIC_RELAXED);
+    } else {
+      memcpy(memfd_map + p * PAGE_SIZE, src + i * PAGE_SIZE, PAGE_SIZE);
+    }
+    __atomic_fetch_or(&filled[p / 64], bit, __ATOMIC_RELEASE);
+  }
+}
+
+// Populate a run of pages from `src`. Snapshot runs are split into
+// zero and non-zero stretches using the precomputed bitmap.
+// In minor fault mode the run goes into the page cache first and is
+// then mapped into `r` with a single UFFDIO_CONTINUE. Returns the
+// number of pages populated by us rather than by a racing fault.
+uint64_t copy_run(struct region* r, uint64_t first, uint64_t npages, char* src) {
+  uint64_t copied;
+  if (minor) {
+    fill_cache(first, npages, src);
+    copied = fill_range(r, first, npages, FILL_CONTINUE, NULL);
+    set_pages(r, first, npages);
+    return copied;
+  }
+
+  // UFFDIO_ZEROPAGE cannot map pages write protected.
+  if (!zero_pages || r->wp || src != snapshot + first * PAGE_SIZE) {
+    copied = fill_range(r, first, npages, FILL_COPY, src);
+    set_pages(r, first, npages);
+    return copied;
+  }
+
+  copied = 0;
+  uint64_t i = 0;
+  while (i < npages) {
+    int zero = zero_page_test(zero_pages, first + i);
+    uint64_t j = i + 1;
+    while (j < npages && zero_page_test(zero_pages, first + j) == zero)
+      j++;
+    if (zero)
+      copied += fill_range(r, first + i, j - i, FILL_ZERO, NULL);
+    else
+      copied += fill_range(r, first + i, j - i, FILL_COPY, src + i * PAGE_SIZE);
+    if (zero)
+      __atomic_fetch_add(&zero_served, j - i, __ATOMIC_RELAXED);
+    i = j;
+  }
+  set_pages(r, first, npages);
+  return copied;
+}
+
+// Set or clear write protection on `len` bytes from `start`. Clearing
+// it also wakes the threads waiting on the range. Returns -1 if the
+// client is gone.
+int protect_range(struct region* r, uint64_t start, uint64_t len, int protect) {
+  struct uffdio_writeprotect wp = {
+    .range = { .start = start, .len = len },
+    .mode = protect ? UFFDIO_WRITEPROTECT_MODE_WP : 0,
   };
+  if (ioctl(r->uffd, UFFDIO_WRITEPROTECT, &wp) == -1) {
+    if (errno == ESRCH)
+      return -1;
+    perror("UFFDIO_WRITEPROTECT");
+    exit(EXIT_FAILURE);
+  }
+  return 0;
+}
 
-  int n = recvmsg(sockfd, &msg, 0);
-  printf("Received: %d bytes\n", n);
+// First write to a protected page since the last checkpoint.
+void serve_wp_fault(struct region* r, uint64_t page_addr) {
+  uint64_t page = (page_addr - r->addr) / PAGE_SIZE;
+  pthread_rwlock_rdlock(&dirty_lock);
+  __atomic_fetch_or(&dirty[page / 64], 1ul << (page % 64), __ATOMIC_RELAXED);
+  protect_range(r, page_addr, PAGE_SIZE, 0);
+  pthread_rwlock_unlock(&dirty_lock);
+  __atomic_fetch_add(&wp_faults, 1, __ATOMIC_RELAXED);
+  if (!quiet)
+    printf("page %p dirty\n", (void*)page_addr);
+}
 
-  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-  int fd = *(int*)CMSG_DATA(cmsg);
+// Forget pages [start, end) of region `r`: the client dropped them
+// (MADV_DONTNEED, MADV_REMOVE) or unmapped them, and a later touch
+// faults again and gets them re-served. In minor fault mode a page
+// punched out of the memfd must be filled again as well, mincore()
+// on our own mapping tells which ones left the page cache.
+uint64_t clear_range(struct region* r, uint64_t start, uint64_t end) {
+  if (start < r->addr)
+    start = r->addr;
+  if (end > r->addr + r->len)
+    end = r->addr + r->len;
+  if (start >= end)
+    return 0;
+  uint64_t first = (start - r->addr + PAGE_SIZE - 1) / PAGE_SIZE;
+  uint64_t last = (end - r->addr) / PAGE_SIZE;
+  for (uint64_t p = first; p < last; p++)
+    __atomic_fetch_and(&r->populated[p / 64], ~(1ul << (p % 64)), __ATOMIC_RELAXED);
 
-  return fd;
+  if (minor && last > first) {
+    unsigned char* resident = malloc(last - first);
+    if (mincore(memfd_map + first * PAGE_SIZE, (last - first) * PAGE_SIZE, resident) == 0) {
+      for (uint64_t p = first; p < last; p++) {
+        if (resident[p - first] & 1)
+          continue;
+        __atomic_fetch_and(&filled[p / 64], ~(1ul << (p % 64)), __ATOMIC_RELAXED);
+        __atomic_fetch_and(&claimed[p / 64], ~(1ul << (p % 64)), __ATOMIC_RELEASE);
+      }
+    }
+    free(resident);
+  }
+  return last > first ? last - first : 0;
 }
 
-int main() {
-  // CREATE SOCKET
-  printf("Creating socket to uffd\n");
-  int sockfd = socket(AF_UNIX, SOCK_DGRAM, 0);
-  if (sockfd < 0) {
-    perror("sockfd failed\n");
+// Pages [start, end) of region `r` left the client's address space
+// (UNMAP, or moved out by a partial REMAP). They are marked unmapped
+// before they are forgotten, so prefetch, the background fill and the
+// replay never see them missing and copy into the hole.
+uint64_t unmap_range(struct region* r, uint64_t start, uint64_t end) {
+  uint64_t lo = start < r->addr ? r->addr : start;
+  uint64_t hi = end > r->addr + r->len ? r->addr + r->len : end;
+  if (lo < hi) {
+    for (uint64_t p = (lo - r->addr) / PAGE_SIZE; p < (hi - r->addr + PAGE_SIZE - 1) / PAGE_SIZE; p++)
+      __atomic_fetch_or(&r->unmapped[p / 64], 1ul << (p % 64), __ATOMIC_RELAXED);
+  }
+  return clear_range(r, start, end);
+}
+
+// A forked child inherits the parent's registration through a new
+// uffd. It maps the same memfd at the same address, so it starts out
+// with the parent's view of what is populated.
+void add_child_region(struct region* parent, int uffd, int epoll_fd) {
+  pthread_mutex_lock(&regions_lock);
+  int i = num_regions;
+  if (i == MAX_REGIONS) {
+    pthread_mutex_unlock(&regions_lock);
+    printf("no room for the region of a forked child, closing its uffd\n");
+    close(uffd);
+    return;
+  }
+  struct region* r = &regions[i];
+  uint64_t words = (region_pages + 63) / 64;
+  r->uffd = uffd;
+  r->addr = parent->addr;
+  r->len = parent->len;
+  r->wp = parent->wp;
+  r->gone = 0;
+  r->populated = malloc(words * sizeof(uint64_t));
+  r->unmapped = malloc(words * sizeof(uint64_t));
+  for (uint64_t j = 0; j < words; j++) {
+    r->populated[j] = __atomic_load_n(&parent->populated[j], __ATOMIC_RELAXED);
+    r->unmapped[j] = __atomic_load_n(&parent->unmapped[j], __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&num_regions, i + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&regions_lock);
+
+  if (epoll_fd >= 0) {
+    struct epoll_event event = {
+      .events = EPOLLIN | EPOLLONESHOT,
+      .data.ptr = r,
+    };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, uffd, &event) == -1) {
+      perror("epoll_ctl add failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+  printf("forked child: region %d, uffd %d\n", i, uffd);
+}
+
+// Everything but page faults. The client is blocked until we have
+// read the message, not until we are done here.
+void serve_event(struct region* r, struct worker* w, struct uffd_msg* msg) {
+  switch (msg->event) {
+    case UFFD_EVENT_REMOVE: {
+      uint64_t n = clear_range(r, msg->arg.remove.start, msg->arg.remove.end);
+      __atomic_fetch_add(&events.remove, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&events.removed_pages, n, __ATOMIC_RELAXED);
+      if (!quiet)
+        printf("region %d: %"PRIu64" pages removed\n", (int)(r - regions), n);
+      break;
+    }
+    case UFFD_EVENT_UNMAP:
+      unmap_range(r, msg->arg.remove.start, msg->arg.remove.end);
+      if (msg->arg.remove.start <= r->addr && msg->arg.remove.end >= r->addr + r->len)
+        r->gone = 1;
+      __atomic_fetch_add(&events.unmap, 1, __ATOMIC_RELAXED);
+      break;
+    case UFFD_EVENT_REMAP:
+      // The pages moved with the mapping, only its address changes.
+      // Part of a region moving elsewhere would make it two regions,
+      // which we do not track: those pages are just forgotten.
+      if (msg->arg.remap.from == r->addr && msg->arg.remap.len == r->len) {
+        r->addr = msg->arg.remap.to;
+      } else {
+        printf("region %d: partial remap, %"PRIu64" bytes no longer served\n",
+               (int)(r - regions), (uint64_t)msg->arg.remap.len);
+        unmap_range(r, msg->arg.remap.from, msg->arg.remap.from + msg->arg.remap.len);
+      }
+      __atomic_fetch_add(&events.remap, 1, __ATOMIC_RELAXED);
+      break;
+    case UFFD_EVENT_FORK:
+      add_child_region(r, msg->arg.fork.ufd, w->epoll_fd);
+      __atomic_fetch_add(&events.fork, 1, __ATOMIC_RELAXED);
+      break;
+    default:
+      printf("Unexpected event on userfaultfd: %d\n", msg->event);
+      exit(EXIT_FAILURE);
+  }
+}
+
+// Resolve a single page fault in region `r` using `w->page` as the
+// staging buffer, or the snapshot mapping if there is one. With a
+// prefetch window the fault also copies the not yet populated pages
+// around it, in one run, ahead of the faulting page first.
+void serve_fault(struct region* r, struct worker* w, struct uffd_msg* msg) {
+  if (msg->event != UFFD_EVENT_PAGEFAULT) {
+    serve_event(r, w, msg);
+    return;
+  }
+
+  if (msg->arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP) {
+    serve_wp_fault(r, (uint64_t)msg->arg.pagefault.address & ~(PAGE_SIZE - 1));
+    return;
+  }
+
+  uint64_t cnt = __atomic_fetch_add(&fault_cnt, 1, __ATOMIC_RELAXED);
+  if (cnt == 0)
+    __atomic_store_n(&first_fault_ns, now_ns(), __ATOMIC_RELAXED);
+  // The page is in the page cache already, only the PTE is missing.
+  if (msg->arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_MINOR)
+    __atomic_fetch_add(&minor_faults, 1, __ATOMIC_RELAXED);
+
+  //We need to handle page faults in units of pages(!).
+  //So, round faulting address down to page boundary.
+  uint64_t page_addr = (uint64_t)msg->arg.pagefault.address & ~(PAGE_SIZE - 1);
+  uint64_t fault_page = (page_addr - r->addr) / PAGE_SIZE;
+
+  // Every region maps the memfd from offset 0, so the offset
+  // into the region is the offset into the snapshot.
+  uint64_t limit = r->len / PAGE_SIZE;
+  if (snapshot && snapshot_size / PAGE_SIZE < limit)
+    limit = snapshot_size / PAGE_SIZE;
+  if (fault_page >= limit) {
+    printf("fault at offset %"PRIu64" is past the snapshot end\n", page_addr - r->addr);
     exit(EXIT_FAILURE);
   }
 
-  struct sockaddr_un server_addr;
-  memset(&server_addr, 0, sizeof(server_addr));
-  server_addr.sun_family = AF_UNIX;
-  strncpy(server_addr.sun_path, UFFD_SOCKET_PATH, strlen(UFFD_SOCKET_PATH));
+  if (record_path) {
+    uint64_t i = __atomic_fetch_add(&records_len, 1, __ATOMIC_RELAXED);
+    if (i < records_cap)
+      records[i] = (uint32_t)(r - regions) << RECORD_PAGE_BITS | fault_page;
+  }
+
+  uint64_t lo = fault_page;
+  uint64_t hi = fault_page + 1;
+  while (hi - lo < prefetch && hi < limit && !test_page(r, hi))
+    hi++;
+  while (hi - lo < prefetch && lo > 0 && !test_page(r, lo - 1))
+    lo--;
+  uint64_t npages = hi - lo;
 
-  unlink(UFFD_SOCKET_PATH);
+  char* src;
+  if (snapshot) {
+    src = snapshot + lo * PAGE_SIZE;
+  } else {
+    //Copy the page pointed to by 'page' into the faulting
+    //region. Vary the contents that are copied in, so that it
+    //is more obvious that each fault is handled separately.
+    memset(w->page, 'A' + cnt % 20, npages * PAGE_SIZE);
+    src = w->page;
+  }
 
-  if (bind(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-    perror("bind failed");
+  uint64_t before = now_ns();
+  copy_run(r, lo, npages, src);
+  uint64_t copy_ns = now_ns() - before;
+  w->copy_ns += copy_ns;
+  w->pages += npages;
+
+  if (!quiet)
+    printf("serving page %p (+%"PRIu64" prefetched) in %"PRIu64" ns\n",
+           page_addr, npages - 1, copy_ns);
+}
+
+void write_records() {
+  uint64_t count = records_len < records_cap ? records_len : records_cap;
+  FILE* f = fopen(record_path, "wb");
+  if (!f) {
+    perror("open record file failed");
+    return;
+  }
+  struct record_header header = {
+    .magic = RECORD_MAGIC,
+    .page_size = PAGE_SIZE,
+    .count = count,
+  };
+  fwrite(&header, sizeof(header), 1, f);
+  fwrite(records, sizeof(uint32_t), count, f);
+  fclose(f);
+  printf("recorded %"PRIu64" faults to %s\n", count, record_path);
+  if (records_len > records_cap)
+    printf("dropped %"PRIu64" faults past the log capacity\n", records_len - records_cap);
+}
+
+void read_records() {
+  FILE* f = fopen(replay_path, "rb");
+  if (!f) {
+    perror("open replay file failed");
     exit(EXIT_FAILURE);
   }
-  printf("socket bind done\n");
+  struct record_header header;
+  if (fread(&header, sizeof(header), 1, f) != 1 ||
+      header.magic != RECORD_MAGIC || header.page_size != PAGE_SIZE) {
+    printf("%s is not a fault log\n", replay_path);
+    exit(EXIT_FAILURE);
+  }
+  // A truncated or corrupt log would read short or ask for a huge
+  // allocation: the count must match the file size exactly.
+  struct stat st;
+  if (fstat(fileno(f), &st) < 0 || st.st_size < sizeof(header) ||
+      header.count != (st.st_size - sizeof(header)) / sizeof(uint32_t) ||
+      (st.st_size - sizeof(header)) % sizeof(uint32_t)) {
+    printf("%s: %"PRIu64" faults in the header do not match the file size\n", replay_path,
+           header.count);
+    exit(EXIT_FAILURE);
+  }
+  records = malloc(header.count * sizeof(uint32_t));
+  if (!records && header.count) {
+    perror("record allocation failed");
+    exit(EXIT_FAILURE);
+  }
+  records_len = fread(records, sizeof(uint32_t), header.count, f);
+  fclose(f);
+  if (records_len != header.count) {
+    printf("%s: read %"PRIu64" of %"PRIu64" faults\n", replay_path, records_len, header.count);
+    exit(EXIT_FAILURE);
+  }
+  printf("loaded %"PRIu64" faults from %s\n", records_len, replay_path);
+}
 
-  // RECIEVE FRONT UFFD FROM FRONT
-  printf("Waiting for front uffd message from frondend\n");
-  uint64_t front_addr;
-  int front_uffd = get_fd_and_addr(sockfd, &front_addr);
-  printf("front_uffd: %d\n", front_uffd);
-  printf("front_addr: %p\n", front_addr);
+// Populate the recorded pages in fault order. Consecutive records of
+// neighbour pages are merged into a single run. Pages the client
+// already faulted in are skipped, and copy_run copes with the client
+// racing us on the rest.
+void* replay_thread(void* arg) {
+  char* page = create_page_buffer(MAX_PREFETCH);
+  uint64_t before = now_ns();
+  uint64_t copied = 0;
+  uint64_t skipped = 0;
 
-  // RECIEVE FRONT UFFD FROM FRONT
-  printf("Waiting for back uffd message from frondend\n");
-  uint64_t back_addr;
-  int back_uffd = get_fd_and_addr(sockfd, &back_addr);
-  printf("back_uffd: %d\n", back_uffd);
-  printf("back_addr: %p\n", back_addr);
+  uint64_t i = 0;
+  while (i < records_len && !stop) {
+    uint32_t region = records[i] >> RECORD_PAGE_BITS;
+    uint64_t first = records[i] & RECORD_PAGE_MASK;
+    i++;
+    if (region >= num_regions || first * PAGE_SIZE >= regions[region].len ||
+        (snapshot && (first + 1) * PAGE_SIZE > snapshot_size))
+      continue;
 
-  // CREATE AN EMPTY PAGE
-  char* page = (char*)mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  if (page == MAP_FAILED) {
-    perror("uffd thread mmap failed");
+    struct region* r = &regions[region];
+    if (r->gone)
+      continue;
+    if (test_page(r, first)) {
+      skipped++;
+      continue;
+    }
+
+    uint64_t npages = 1;
+    while (i < records_len && npages < MAX_PREFETCH &&
+           records[i] == (region << RECORD_PAGE_BITS | (first + npages)) &&
+           (first + npages + 1) * PAGE_SIZE <= r->len &&
+           (!snapshot || (first + npages + 1) * PAGE_SIZE <= snapshot_size) &&
+           !test_page(r, first + npages)) {
+      npages++;
+      i++;
+    }
+
+    char* src;
+    if (snapshot) {
+      src = snapshot + first * PAGE_SIZE;
+    } else {
+      memset(page, 'A' + copied % 20, npages * PAGE_SIZE);
+      src = page;
+    }
+    copy_run(r, first, npages, src);
+    copied += npages;
+  }
+
+  printf("replayed %"PRIu64" pages in %"PRIu64" us, %"PRIu64" were already faulted in\n",
+         copied, (now_ns() - before) / 1000, skipped);
+  return NULL;
+}
+
+// Write the pages dirtied since the previous checkpoint to
+// `dirty_path`.N: a header, the page indexes, then the page contents.
+// The dirty set is taken and the region re-protected in one go, with
+// no write-protect fault in flight, so every later write faults again
+// and lands in the next snapshot.
+void write_checkpoint() {
+  struct region* r = &regions[0];
+  uint64_t words = (region_pages + 63) / 64;
+  uint64_t* pages = malloc(words * sizeof(uint64_t));
+
+  uint64_t before = now_ns();
+  pthread_rwlock_wrlock(&dirty_lock);
+  memcpy(pages, dirty, words * sizeof(uint64_t));
+  memset(dirty, 0, words * sizeof(uint64_t));
+  int protected = protect_range(r, r->addr, r->len, 1) == 0;
+  if (!protected)
+    printf("front exited, region not re-protected\n");
+  pthread_rwlock_unlock(&dirty_lock);
+  uint64_t protect_ns = now_ns() - before;
+
+  char path[4096];
+  snprintf(path, sizeof(path), "%s.%d", dirty_path, checkpoints++);
+  FILE* f = fopen(path, "wb");
+  if (!f) {
+    perror("open snapshot file failed");
+    free(pages);
+    return;
+  }
+  struct dirty_header header = {
+    .magic = DIRTY_MAGIC,
+    .page_size = PAGE_SIZE,
+    .count = 0,
+  };
+  for (uint64_t i = 0; i < words; i++)
+    header.count += __builtin_popcountl(pages[i]);
+  fwrite(&header, sizeof(header), 1, f);
+  for (uint64_t p = 0; p < region_pages; p++)
+    if ((pages[p / 64] >> (p % 64)) & 1)
+      fwrite(&p, sizeof(uint64_t), 1, f);
+  for (uint64_t p = 0; p < region_pages; p++)
+    if ((pages[p / 64] >> (p % 64)) & 1)
+      fwrite(memfd_map + p * PAGE_SIZE, PAGE_SIZE, 1, f);
+  fclose(f);
+  free(pages);
+
+  printf("checkpoint %s: %"PRIu64" of %d pages dirty, written in %"PRIu64" us",
+         path, header.count, region_pages, (now_ns() - before) / 1000);
+  if (protected)
+    printf(", re-protected %"PRIu64" KiB in %"PRIu64" us", r->len / 1024, protect_ns / 1000);
+  printf("\n");
+}
+
+// Checkpoints are requested with SIGUSR1 and taken here, off the
+// fault path.
+void* checkpoint_thread(void* arg) {
+  while (!stop) {
+    if (checkpoint_requested) {
+      checkpoint_requested = 0;
+      write_checkpoint();
+    }
+    usleep(100000);
+  }
+  return NULL;
+}
+
+// Populated pages of the first `n` regions, and in `total` how many of
+// their pages are still mapped and could be.
+uint64_t count_populated(int n, uint64_t* total) {
+  uint64_t count = 0;
+  *total = (uint64_t)n * region_pages;
+  for (int i = 0; i < n; i++) {
+    for (uint64_t j = 0; j < (region_pages + 63) / 64; j++) {
+      count += __builtin_popcountl(__atomic_load_n(&regions[i].populated[j], __ATOMIC_RELAXED));
+      *total -= __builtin_popcountl(__atomic_load_n(&regions[i].unmapped[j], __ATOMIC_RELAXED));
+    }
+  }
+  return count;
+}
+
+// One pass over every region, copying each run of unpopulated pages
+// in chunks. The pass is not repeated: pages a REMOVE or UNMAP event
+// forgets behind it are not filled again, the next touch faults them
+// in on demand like any other page. Progress is printed every second.
+void* fill_thread(void* arg) {
+  // Only run when the CPU has nothing better to do.
+  struct sched_param param = { .sched_priority = 0 };
+  pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+  int chunk = FILL_CHUNK_BYTES / PAGE_SIZE ? FILL_CHUNK_BYTES / PAGE_SIZE : 1;
+  char* page = create_page_buffer(chunk);
+  // Progress and the report cover the regions that came with the
+  // setup. Regions of forked children start out with their parent's
+  // pages, so they are filled but not counted; their pages go to
+  // child_pages.
+  int initial = num_regions;
+  uint64_t total;
+  uint64_t child_pages = 0;
+  uint64_t start = now_ns();
+  uint64_t last_report = start;
+  uint64_t bytes = 0;
+
+  for (int i = 0; i < num_regions && !stop; i++) {
+    struct region* r = &regions[i];
+    uint64_t limit = r->len / PAGE_SIZE;
+    if (snapshot && snapshot_size / PAGE_SIZE < limit)
+      limit = snapshot_size / PAGE_SIZE;
+
+    uint64_t p = 0;
+    while (p < limit && !stop && !r->gone) {
+      if (test_page(r, p)) {
+        p++;
+        continue;
+      }
+      // Demand faults go first.
+      if (__atomic_load_n(&demand_busy, __ATOMIC_RELAXED)) {
+        fill_preempted++;
+        while (__atomic_load_n(&demand_busy, __ATOMIC_RELAXED) && !stop)
+          sched_yield();
+      }
+
+      uint64_t npages = 1;
+      while (npages < chunk && p + npages < limit && !test_page(r, p + npages))
+        npages++;
+      char* src;
+      if (snapshot) {
+        src = snapshot + p * PAGE_SIZE;
+      } else {
+        memset(page, 'A' + fill_pages % 20, npages * PAGE_SIZE);
+        src = page;
+      }
+      uint64_t copied = copy_run(r, p, npages, src);
+      if (i < initial)
+        __atomic_fetch_add(&fill_pages, copied, __ATOMIC_RELAXED);
+      else
+        child_pages += copied;
+      p += npages;
+      bytes += npages * PAGE_SIZE;
+
+      // Stay under the cap: sleep off any lead over fill_rate.
+      uint64_t now = now_ns();
+      if (fill_rate > 0) {
+        uint64_t due = start + bytes * 1000000000ul / ((uint64_t)fill_rate << 20);
+        if (due > now) {
+          usleep((due - now) / 1000);
+          now = now_ns();
+        }
+      }
+      if (now - last_report >= 1000000000ul) {
+        last_report = now;
+        uint64_t populated = count_populated(initial, &total);
+        printf("fill: %"PRIu64" of %"PRIu64" pages populated after %"PRIu64" ms\n",
+               populated, total, (now - start) / 1000000);
+      }
+    }
+  }
+
+  // Pages beyond the snapshot, of regions whose client exited, or
+  // forgotten again since are not populated when the pass is through.
+  // Unmapped pages are left out of the total.
+  uint64_t elapsed = now_ns() - start;
+  uint64_t populated = count_populated(initial, &total);
+  uint64_t demand = populated > fill_pages ? populated - fill_pages : 0;
+  uint64_t filled = fill_pages + child_pages;
+  if (!stop) {
+    printf("fill: pass done after %"PRIu64" ms, %"PRIu64" of %"PRIu64" pages populated, "
+           "%"PRIu64" by the background fill (%.1f MiB/s), %"PRIu64" by demand faults%s, "
+           "%"PRIu64" preemptions\n",
+           elapsed / 1000000, populated, total, fill_pages,
+           elapsed ? (filled * PAGE_SIZE / 1048576.0) * 1e9 / elapsed : 0.0,
+           demand, replay_path ? " and the replay" : "", fill_preempted);
+    if (num_regions > initial)
+      printf("fill: %"PRIu64" more pages filled into %d regions of forked children\n",
+             child_pages, num_regions - initial);
+  }
+  return NULL;
+}
+
+// Read up to `max` messages from the nonblocking `uffd` with a single
+// read(). Returns the number of messages read, 0 if the queue is empty.
+int read_msgs(int uffd, struct uffd_msg* msgs, int max) {
+  int nread = read(uffd, msgs, max * sizeof(struct uffd_msg));
+  if (nread == 0) {
+      perror("EOF on userfaultfd");
+      exit(EXIT_FAILURE);
+  }
+
+  if (nread == -1) {
+    if (errno == EAGAIN)
+      return 0;
+    perror("uffd read failed");
     exit(EXIT_FAILURE);
   }
+  return nread / sizeof(struct uffd_msg);
+}
 
-  // Loop, handling incoming events on the userfaultfd file descriptor.
-  // Number of faults so far handled
-  int fault_cnt = 0; 
-  for (;;) {
-      struct pollfd pollfds[] = {
-        {
-          .fd = front_uffd,
-          .events = POLLIN,
-        },
-        {
-          .fd = back_uffd,
-          .events = POLLIN,
-        },
-      };
-      int nready = poll(pollfds, 2, -1);
+// Original single threaded server: poll all uffds and serve
+// faults one by one. Kept around to compare against the workers.
+void serve_poll() {
+  struct worker w = { 0 };
+  w.epoll_fd = -1;
+  w.page = create_page();
+
+  struct pollfd pollfds[MAX_REGIONS];
+  while (!stop) {
+      for (int i = 0; i < num_regions; i++) {
+        pollfds[i].fd = regions[i].uffd;
+        pollfds[i].events = POLLIN;
+      }
+      int nready = poll(pollfds, num_regions, 100);
       if (nready == -1) {
+        if (errno == EINTR)
+          continue;
         perror("poll failed");
         exit(EXIT_FAILURE);
       }
-      printf("Got %d ready fds\n", nready);
+      if (nready && !quiet)
+        printf("Got %d ready fds\n", nready);
 
-      for (int i = 0; i < 2; i++) {
+      for (int i = 0; i < num_regions; i++) {
         if (pollfds[i].revents & POLLIN) {
-          struct pollfd ready = pollfds[i];
-          int ready_fd = ready.fd;
-          printf("Polled fd: %d\n", ready_fd);
+          int ready_fd = pollfds[i].fd;
+          if (!quiet)
+            printf("Polled fd: %d\n", ready_fd);
 
           // Read an event from the userfaultfd.
           struct uffd_msg msg;
-          int nread = read(ready_fd, &msg, sizeof(msg));
-          if (nread == 0) {
-              perror("EOF on userfaultfd");
-              exit(EXIT_FAILURE);
-          }
-
-          if (nread == -1){
-            perror("uffd read failed");
-            exit(EXIT_FAILURE);
-          }
-
-          // We expect only one kind of event; verify that assumption.
-          if (msg.event != UFFD_EVENT_PAGEFAULT) {
-              perror("Unexpected event on userfaultfd");
-              exit(EXIT_FAILURE);
-          }
-
-          //Copy the page pointed to by 'page' into the faulting
-          //region. Vary the contents that are copied in, so that it
-          //is more obvious that each fault is handled separately. 
-          memset(page, 'A' + fault_cnt % 20, PAGE_SIZE);
-          fault_cnt++;
-
-          struct uffdio_copy uffdio_copy;
-          uffdio_copy.src = (unsigned long) page;
-
-          //We need to handle page faults in units of pages(!).
-          //So, round faulting address down to page boundary.
-          uint64_t page_addr = (uint64_t)msg.arg.pagefault.address & ~(PAGE_SIZE - 1);
-
-          printf("serving page %p\n", page_addr);
-
-          uffdio_copy.dst = page_addr;
-          uffdio_copy.len = PAGE_SIZE;
-          uffdio_copy.mode = 0;
-          uffdio_copy.copy = 0;
-          if (ioctl(ready_fd, UFFDIO_COPY, &uffdio_copy) == -1) {
-              perror("UFFDIO_COPY");
-              printf("Continuing");
-              struct uffdio_continue uffdio_continue;
-              uffdio_continue.range.start = (unsigned long) msg.arg.pagefault.address & ~(PAGE_SIZE - 1);
-              uffdio_continue.range.len = PAGE_SIZE;
-              uffdio_continue.mode = 0;
-              uffdio_continue.mapped = 0;
-
-              if (ioctl(ready_fd, UFFDIO_CONTINUE, &uffdio_continue) == -1) {
-                  perror("UFFDIO_CONTINUE");
-                  exit(EXIT_FAILURE);
-              }
-          }
+          if (!read_msgs(ready_fd, &msg, 1))
+            continue;
+          __atomic_fetch_add(&demand_busy, 1, __ATOMIC_RELAXED);
+          serve_fault(&regions[i], &w, &msg);
+          __atomic_fetch_sub(&demand_busy, 1, __ATOMIC_RELAXED);
+          w.faults++;
+          w.last_fault_ns = now_ns();
         }
       }
   }
 
+  printf("poll loop: %"PRIu64" faults\n", w.faults);
+  uint64_t elapsed = w.last_fault_ns - first_fault_ns;
+  if (w.faults && elapsed)
+    printf("total: %"PRIu64" faults in %"PRIu64" us, %.0f faults/s\n",
+           w.faults, elapsed / 1000, w.faults * 1e9 / elapsed);
+  if (w.faults)
+    printf("avg UFFDIO_COPY latency: %"PRIu64" ns/fault, %.2f pages/fault\n",
+           w.copy_ns / w.faults, (double)w.pages / w.faults);
+}
+
+// Worker thread: every uffd is registered in the shared epoll set with
+// EPOLLONESHOT, so a ready uffd is handed to exactly one worker. The worker
+// drains up to msgs_per_read messages per read(), serves the whole batch and
+// re-arms the fd, letting any idle worker pick it up next.
+void* fault_worker(void* arg) {
+  struct worker* w = (struct worker*)arg;
+  struct uffd_msg msgs[MAX_MSGS_PER_READ];
+
+  while (!stop) {
+    struct epoll_event event;
+    int nready = epoll_wait(w->epoll_fd, &event, 1, 100);
+    if (nready == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait failed");
+      exit(EXIT_FAILURE);
+    }
+    if (nready == 0)
+      continue;
+    w->syscalls++;
+
+    struct region* r = (struct region*)event.data.ptr;
+
+    // Read events from the userfaultfd. A full batch means more
+    // may be queued, so keep reading until a short read.
+    __atomic_fetch_add(&demand_busy, 1, __ATOMIC_RELAXED);
+    for (;;) {
+      int nmsgs = read_msgs(r->uffd, msgs, msgs_per_read);
+      w->syscalls++;
+      for (int i = 0; i < nmsgs; i++)
+        serve_fault(r, w, &msgs[i]);
+      if (nmsgs) {
+        w->faults += nmsgs;
+        w->last_fault_ns = now_ns();
+      }
+      if (msgs_per_read == 1 || nmsgs < msgs_per_read)
+        break;
+    }
+    __atomic_fetch_sub(&demand_busy, 1, __ATOMIC_RELAXED);
+
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = r;
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, r->uffd, &event) == -1) {
+      perror("epoll_ctl rearm failed");
+      exit(EXIT_FAILURE);
+    }
+    w->syscalls++;
+  }
+
+  return NULL;
+}
+
+void serve_epoll() {
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    perror("epoll_create1 failed");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < num_regions; i++) {
+    struct epoll_event event = {
+      .events = EPOLLIN | EPOLLONESHOT,
+      .data.ptr = &regions[i],
+    };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, regions[i].uffd, &event) == -1) {
+      perror("epoll_ctl add failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  struct worker workers[MAX_WORKERS] = { 0 };
+  for (int i = 0; i < num_workers; i++) {
+    workers[i].id = i;
+    workers[i].epoll_fd = epoll_fd;
+    workers[i].page = create_page();
+    if (pthread_create(&workers[i].thread, NULL, fault_worker, &workers[i]) != 0) {
+      printf("worker thread creation failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  printf("Started %d workers\n", num_workers);
+
+  uint64_t total = 0;
+  uint64_t syscalls = 0;
+  uint64_t copy_ns = 0;
+  uint64_t pages = 0;
+  uint64_t last_fault_ns = 0;
+  for (int i = 0; i < num_workers; i++) {
+    pthread_join(workers[i].thread, NULL);
+    printf("worker %d: %"PRIu64" faults\n", i, workers[i].faults);
+    total += workers[i].faults;
+    syscalls += workers[i].syscalls;
+    copy_ns += workers[i].copy_ns;
+    pages += workers[i].pages;
+    if (workers[i].last_fault_ns > last_fault_ns)
+      last_fault_ns = workers[i].last_fault_ns;
+  }
+
+  uint64_t elapsed = last_fault_ns - first_fault_ns;
+  if (total && elapsed)
+    printf("total: %"PRIu64" faults in %"PRIu64" us, %.0f faults/s\n",
+           total, elapsed / 1000, total * 1e9 / elapsed);
+  // Reading one message per wakeup costs epoll_wait, read and epoll_ctl.
+  if (total)
+    printf("%.2f epoll/read syscalls per fault (one message per read: 3.00)\n",
+           (double)syscalls / total);
+  if (total)
+    printf("avg UFFDIO_COPY latency: %"PRIu64" ns/fault, %.2f pages/fault\n",
+           copy_ns / total, (double)pages / total);
+  close(epoll_fd);
+}
+
+// Receive the front memfd after the uffds and map it, unregistered,
+// so pages can be written into its page cache and dirty pages read
+// back out of it.
+void map_memfd(int fd) {
+  memfd = fd;
+
+  struct stat st;
+  if (fstat(memfd, &st) < 0) {
+    perror("memfd fstat failed");
+    exit(EXIT_FAILURE);
+  }
+  memfd_size = st.st_size;
+  if (st.st_blksize != PAGE_SIZE || memfd_size < (uint64_t)region_pages * PAGE_SIZE) {
+    printf("memfd of %"PRIu64" bytes in %d byte pages does not back %d pages of %d bytes\n",
+           memfd_size, (int)st.st_blksize, region_pages, PAGE_SIZE);
+    exit(EXIT_FAILURE);
+  }
+
+  memfd_map = (char*)mmap(NULL, memfd_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (memfd_map == MAP_FAILED) {
+    perror("memfd map failed");
+    exit(EXIT_FAILURE);
+  }
+  uint64_t pages = memfd_size / PAGE_SIZE;
+  claimed = calloc((pages + 63) / 64, sizeof(uint64_t));
+  filled = calloc((pages + 63) / 64, sizeof(uint64_t));
+  printf("memfd: %d, %"PRIu64" bytes\n", memfd, memfd_size);
+}
+
+// Take over the regions of one setup message as regions[first...].
+// Returns 0, or the errno to reject the message with. Every region
+// must be `-s` pages of our page size, and the memfd, needed with -m
+// and -d, must back the regions from its start. A message without
+// regions has to bring at least the memfd.
+int take_setup(struct uffd_setup* s, int first) {
+  if (s->hdr.num_regions == 0 && s->hdr.memfd < 0) {
+    printf("setup brings neither regions nor a memfd\n");
+    return EINVAL;
+  }
+  if (first + s->hdr.num_regions > num_regions) {
+    printf("setup brings %d regions, %d expected\n", first + s->hdr.num_regions, num_regions);
+    return E2BIG;
+  }
+  for (int i = 0; i < s->hdr.num_regions; i++) {
+    struct uffd_setup_region* sr = &s->regions[i];
+    if (sr->uffd < 0 || sr->page_size != PAGE_SIZE ||
+        sr->len != (uint64_t)region_pages * PAGE_SIZE ||
+        (s->hdr.memfd >= 0 && sr->memfd_offset != 0)) {
+      printf("region of %"PRIu64" bytes in %u byte pages at memfd offset %"PRIu64
+             " does not match %d pages of %d bytes\n", sr->len, sr->page_size, sr->memfd_offset,
+             region_pages, PAGE_SIZE);
+      return EINVAL;
+    }
+  }
+
+  int used[UFFD_SETUP_MAX_FDS] = { 0 };
+  for (int i = 0; i < s->hdr.num_regions; i++) {
+    struct region* r = &regions[first + i];
+    r->uffd = s->fds[s->regions[i].uffd];
+    r->addr = s->regions[i].start;
+    r->len = s->regions[i].len;
+    r->populated = calloc((region_pages + 63) / 64, sizeof(uint64_t));
+    r->unmapped = calloc((region_pages + 63) / 64, sizeof(uint64_t));
+    used[s->regions[i].uffd] = 1;
+    printf("region %d: uffd %d, addr %p\n", first + i, r->uffd, (void*)r->addr);
+  }
+  if (s->hdr.memfd >= 0 && (minor || dirty_path) && memfd < 0) {
+    map_memfd(s->fds[s->hdr.memfd]);
+    used[s->hdr.memfd] = 1;
+  }
+  for (int i = 0; i < s->hdr.num_fds; i++) {
+    if (!used[i])
+      close(s->fds[i]);
+  }
+  return 0;
+}
+
+void usage(const char* name) {
+  printf("Usage: %s [-w workers] [-n regions] [-s pages] [-b msgs] [-p pages] [-f snapshot] [-z scanner] [-H]\n"
+         "       [-r record_file | -R replay_file] [-m] [-d snapshot_file] [-F MiB/s] [-E threads] [-q]\n", name);
+  printf("  -w  number of fault worker threads, 0 for the single poll loop (default %d)\n", num_workers);
+  printf("  -n  number of uffd regions to receive (default %d)\n", num_regions);
+  printf("  -s  size of every region in pages (default %d)\n", region_pages);
+  printf("  -b  max uffd messages drained per read() (default %d, max %d)\n",
+         msgs_per_read, MAX_MSGS_PER_READ);
+  printf("  -p  prefetch window: max pages copied per fault (default %d, max %d)\n",
+         prefetch, MAX_PREFETCH);
+  printf("  -f  serve pages from this snapshot file instead of memset pages\n");
+  printf("  -z  zero page scanner for the snapshot: scalar, sse2, avx2, neon\n"
+         "      or none (default: the widest one the CPU supports)\n");
+  printf("  -H  regions are hugetlb memfds, serve faults in 2 MiB pages\n");
+  printf("  -r  record the demand fault order into this file\n");
+  printf("  -R  pre-populate the pages recorded in this file, in order\n");
+  printf("  -m  minor fault mode: fill the front memfd page cache once and map it\n"
+         "      into every region with UFFDIO_CONTINUE (front and back need -m too)\n");
+  printf("  -d  track writes to the front region and write the dirty pages to\n"
+         "      snapshot_file.N on SIGUSR1 and on exit (front needs -d too)\n");
+  printf("  -F  populate the remaining pages in the background at up to this\n"
+         "      rate, 0 for no cap; demand faults always go first\n");
+  printf("  -E  read the whole snapshot into memory with this many threads\n"
+         "      before serving, instead of mapping the file\n");
+  printf("  -q  do not print every served fault\n");
+}
+
+int main(int argc, char** argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "w:n:s:b:p:f:z:Hr:R:md:F:E:qh")) != -1) {
+    switch (opt) {
+      case 'w': num_workers = atoi(optarg); break;
+      case 'n': num_regions = atoi(optarg); break;
+      case 's': region_pages = atoi(optarg); break;
+      case 'b': msgs_per_read = atoi(optarg); break;
+      case 'p': prefetch = atoi(optarg); break;
+      case 'f': snapshot_path = optarg; break;
+      case 'z': zero_scanner_name = optarg; break;
+      case 'H': PAGE_SIZE = HUGE_PAGE_SIZE; break;
+      case 'r': record_path = optarg; break;
+      case 'R': replay_path = optarg; break;
+      case 'm': minor = 1; break;
+      case 'd': dirty_path = optarg; break;
+      case 'F': fill_rate = atoi(optarg); break;
+      case 'E': eager_threads = atoi(optarg); break;
+      case 'q': quiet = 1; break;
+      default: usage(argv[0]); exit(EXIT_FAILURE);
+    }
+  }
+  if (num_workers < 0 || num_workers > MAX_WORKERS ||
+      num_regions < 1 || num_regions > MAX_REGIONS ||
+      msgs_per_read < 1 || msgs_per_read > MAX_MSGS_PER_READ ||
+      prefetch < 1 || prefetch > MAX_PREFETCH || region_pages < 1 ||
+      region_pages > RECORD_PAGE_MASK || (record_path && replay_path) ||
+      (minor && dirty_path) || eager_threads < 0 || eager_threads > LOADER_MAX_THREADS) {
+    usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  if (snapshot_path) {
+    if (eager_threads)
+      load_snapshot(snapshot_path);
+    else
+      map_snapshot(snapshot_path);
+    scan_snapshot();
+  }
+  if (replay_path)
+    read_records();
+
+  struct sigaction sa = { .sa_handler = on_sigint };
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  struct sigaction usr1 = { .sa_handler = on_sigusr1 };
+  sigemptyset(&usr1.sa_mask);
+  sigaction(SIGUSR1, &usr1, NULL);
+
+  // ACCEPT SETUP MESSAGES
+  // Every client connects and sends its uffds, the memfd and the
+  // region table in one message. All are acked once the last region
+  // is in and set up, so clients start faulting right after the ack.
+  int sockfd = uffd_setup_listen(UFFD_SOCKET_PATH, MAX_REGIONS);
+  if (sockfd < 0) {
+    perror("uffd socket failed");
+    exit(EXIT_FAILURE);
+  }
+  printf("listening on %s\n", UFFD_SOCKET_PATH);
+
+  int conns[MAX_REGIONS];
+  int num_conns = 0;
+  for (int received = 0; received < num_regions; ) {
+    printf("Waiting for setup, %d of %d regions received\n", received, num_regions);
+    int connfd = accept(sockfd, NULL, NULL);
+    if (connfd < 0) {
+      perror("accept failed");
+      exit(EXIT_FAILURE);
+    }
+    struct uffd_setup setup;
+    int err = 0;
+    if (uffd_setup_recv(connfd, &setup) < 0) {
+      err = errno;
+    } else if (num_conns == MAX_REGIONS) {
+      // Every connection is held open until the final ack.
+      printf("%d clients connected, no room for another\n", num_conns);
+      err = ENOSPC;
+      uffd_setup_close(&setup);
+    } else if ((err = take_setup(&setup, received)) != 0) {
+      uffd_setup_close(&setup);
+    }
+    if (err) {
+      printf("setup rejected: %s\n", strerror(err));
+      uffd_setup_ack(connfd, err);
+      close(connfd);
+      continue;
+    }
+    received += setup.hdr.num_regions;
+    conns[num_conns++] = connfd;
+  }
+  if ((minor || dirty_path) && memfd < 0) {
+    printf("no client sent the memfd, needed with -m and -d\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Protect the whole front region up front, holes included, so
+  // pages that reach the page cache through another region are
+  // tracked too.
+  pthread_t checkpointer;
+  if (dirty_path) {
+    regions[0].wp = 1;
+    dirty = calloc((region_pages + 63) / 64, sizeof(uint64_t));
+    protect_range(&regions[0], regions[0].addr, regions[0].len, 1);
+    if (pthread_create(&checkpointer, NULL, checkpoint_thread, NULL) != 0) {
+      printf("checkpoint thread creation failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  for (int i = 0; i < num_conns; i++) {
+    uffd_setup_ack(conns[i], 0);
+    close(conns[i]);
+  }
+
+  if (record_path) {
+    // Every page faults at most once.
+    records_cap = (uint64_t)num_regions * region_pages;
+    records = malloc(records_cap * sizeof(uint32_t));
+  }
+
+  // Replay runs next to the fault handlers, so the client
+  // can start right away.
+  pthread_t replay;
+  if (replay_path && pthread_create(&replay, NULL, replay_thread, NULL) != 0) {
+    printf("replay thread creation failed\n");
+    exit(EXIT_FAILURE);
+  }
+  pthread_t filler;
+  if (fill_rate >= 0 && pthread_create(&filler, NULL, fill_thread, NULL) != 0) {
+    printf("fill thread creation failed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Loop, handling incoming events on the userfaultfds.
+  if (num_workers == 0)
+    serve_poll();
+  else
+    serve_epoll();
+
+  if (replay_path)
+    pthread_join(replay, NULL);
+  if (fill_rate >= 0)
+    pthread_join(filler, NULL);
+  if (record_path)
+    write_records();
+  if (dirty_path) {
+    pthread_join(checkpointer, NULL);
+    write_checkpoint();
+    printf("write-protect faults: %"PRIu64"\n", wp_faults);
+  }
+  if (zero_pages)
+    printf("zero pages served with %s: %"PRIu64"\n",
+           minor ? "fallocate" : "UFFDIO_ZEROPAGE", zero_served);
+  if (events.remove || events.unmap || events.remap || events.fork)
+    printf("events: %"PRIu64" remove (%"PRIu64" pages), %"PRIu64" unmap, "
+           "%"PRIu64" remap, %"PRIu64" fork\n", events.remove, events.removed_pages,
+           events.unmap, events.remap, events.fork);
+  if (minor)
+    printf("minor faults: %"PRIu64" of %"PRIu64", page already in the page cache\n",
+           minor_faults, fault_cnt);
+
+  close(sockfd);
   return 0;
 }